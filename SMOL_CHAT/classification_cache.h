@@ -0,0 +1,261 @@
+// classification_cache.h
+// Result cache for /ai/inbox/classify. Bulk mail (newsletters, automated
+// notifications) arrives in near-identical copies, so results are keyed by
+// a normalised form of subject + body, with lower case, collapsed
+// whitespace, and links and digit runs (dates, times, tracking ids) removed,
+// plus the attachment hashes. Optionally, a SimHash of the normalised text
+// also finds near-duplicates, e.g. the same mailing with a different
+// recipient name.
+
+#pragma once
+
+#include "request_capture.h"   // fnv1a64
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory_resource>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Lower-cases, drops URLs, replaces digit runs with '#' and collapses
+// whitespace, so per-recipient links and timestamps don't change the key
+inline std::pmr::string normalize_email_text(const std::string& text,
+                                             std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+    std::pmr::string out(mr);
+    out.reserve(text.size());
+    bool pending_space = false;
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = text[i];
+        if ((c == 'h' || c == 'H') &&
+            (text.compare(i, 7, "http://") == 0 || text.compare(i, 8, "https://") == 0 ||
+             text.compare(i, 7, "HTTP://") == 0 || text.compare(i, 8, "HTTPS://") == 0)) {
+            while (i < text.size() && !std::isspace((unsigned char)text[i]) && text[i] != '>' && text[i] != ')') ++i;
+            pending_space = true;
+            continue;
+        }
+        if (std::isspace(c)) {
+            pending_space = true;
+            ++i;
+            continue;
+        }
+        if (pending_space && !out.empty()) out += ' ';
+        pending_space = false;
+        if (std::isdigit(c)) {
+            out += '#';
+            while (i < text.size() && std::isdigit((unsigned char)text[i])) ++i;
+            continue;
+        }
+        out += static_cast<char>(std::tolower(c));
+        ++i;
+    }
+    return out;
+}
+
+// 64-bit SimHash over word trigrams. Texts that differ in a few words end
+// up a few bits apart.
+inline uint64_t simhash64(std::string_view normalized,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+    std::pmr::vector<std::string_view> words(mr);
+    for (size_t i = 0; i < normalized.size();) {
+        size_t end = normalized.find_first_of(" \n", i);
+        if (end == std::string_view::npos) end = normalized.size();
+        if (end > i) words.push_back(normalized.substr(i, end - i));
+        i = end + 1;
+    }
+    if (words.empty()) return 0;
+
+    int weights[64] = {0};
+    const size_t n = words.size() < 3 ? 1 : words.size() - 2;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t j = i; j < std::min(i + 3, words.size()); ++j) {
+            h = fnv1a64(words[j].data(), words[j].size(), h);
+            h = fnv1a64(" ", 1, h);
+        }
+        for (int b = 0; b < 64; ++b) weights[b] += (h >> b) & 1 ? 1 : -1;
+    }
+    uint64_t out = 0;
+    for (int b = 0; b < 64; ++b) {
+        if (weights[b] > 0) out |= 1ULL << b;
+    }
+    return out;
+}
+
+struct ClassificationKey {
+    uint64_t exact = 0;         // normalised subject + body + attachments
+    uint64_t simhash = 0;       // normalised subject + body only
+    uint64_t attachments = 0;   // near-duplicates must have the same files
+};
+
+// mr holds the normalised text while the key is computed
+inline ClassificationKey classification_key(const std::string& subject, const std::string& body,
+                                            const std::vector<uint64_t>& attachment_hashes,
+                                            std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
+    std::pmr::string text = normalize_email_text(subject, mr);
+    text += '\n';
+    text += normalize_email_text(body, mr);
+    ClassificationKey key;
+    key.attachments = 0xcbf29ce484222325ULL;
+    for (uint64_t h : attachment_hashes) key.attachments = fnv1a64(&h, sizeof(h), key.attachments);
+    key.exact = fnv1a64(text.data(), text.size(), key.attachments);
+    key.simhash = simhash64(text, mr);
+    return key;
+}
+
+// LRU of classification results (stored as the response JSON fragment).
+// Thread-safe. Capacity 0 disables the cache.
+class ClassificationCache {
+public:
+    enum class Hit { None, Exact, Near };
+
+    struct Stats {
+        size_t entries = 0;
+        size_t capacity = 0;
+        uint64_t hits_exact = 0;
+        uint64_t hits_near = 0;
+        uint64_t misses = 0;
+    };
+
+    // max_distance: SimHash bits that may differ for a near-duplicate hit;
+    // 0 turns near-duplicate lookup off. At most kBands - 1, since two
+    // hashes that close share at least one whole band.
+    ClassificationCache(size_t capacity, int max_distance)
+        : capacity(capacity), max_distance(std::min(std::max(max_distance, 0), kBands - 1)) {}
+
+    bool enabled() const { return capacity > 0; }
+
+    Hit lookup(const ClassificationKey& key, std::string& result) {
+        if (!enabled()) return Hit::None;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_exact.find(key.exact);
+        if (it != by_exact.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            result = it->second->result;
+            ++stats.hits_exact;
+            return Hit::Exact;
+        }
+        if (max_distance > 0 && key.simhash != 0) {
+            for (int band = 0; band < kBands; ++band) {
+                auto range = by_band[band].equal_range(band_value(key.simhash, band));
+                for (auto b = range.first; b != range.second; ++b) {
+                    Entry& e = *b->second;
+                    if (e.key.attachments == key.attachments &&
+                        __builtin_popcountll(e.key.simhash ^ key.simhash) <= max_distance) {
+                        lru.splice(lru.begin(), lru, b->second);
+                        result = e.result;
+                        ++stats.hits_near;
+                        return Hit::Near;
+                    }
+                }
+            }
+        }
+        ++stats.misses;
+        return Hit::None;
+    }
+
+    void insert(const ClassificationKey& key, const std::string& result) {
+        if (!enabled()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        insert_locked(key, result);
+    }
+
+    Stats snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s = stats;
+        s.entries = lru.size();
+        s.capacity = capacity;
+        return s;
+    }
+
+    // Text file, one entry per line, most recently used last:
+    //   exact<TAB>simhash<TAB>attachments<TAB>result-json
+    void load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string line;
+        size_t n = 0;
+        while (std::getline(in, line)) {
+            ClassificationKey key;
+            char result[4096];
+            unsigned long long exact, sim, att;
+            if (sscanf(line.c_str(), "%llx\t%llx\t%llx\t%4095[^\n]", &exact, &sim, &att, result) != 4) continue;
+            key.exact = exact;
+            key.simhash = sim;
+            key.attachments = att;
+            insert_locked(key, result);
+            ++n;
+        }
+        std::cout << "[CACHE] Loaded " << n << " classification results from " << path << std::endl;
+    }
+
+    void save(const std::string& path) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f) throw std::runtime_error("Cannot write classification cache: " + tmp);
+        for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+            fprintf(f, "%016llx\t%016llx\t%016llx\t%s\n", (unsigned long long)it->key.exact,
+                    (unsigned long long)it->key.simhash, (unsigned long long)it->key.attachments,
+                    it->result.c_str());
+        }
+        if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot write classification cache: " + path);
+        }
+    }
+
+private:
+    struct Entry {
+        ClassificationKey key;
+        std::string result;
+    };
+    using EntryList = std::list<Entry>;
+
+    static constexpr int kBands = 8;
+    static uint8_t band_value(uint64_t simhash, int band) { return (simhash >> (band * 8)) & 0xff; }
+
+    void insert_locked(const ClassificationKey& key, const std::string& result) {
+        auto it = by_exact.find(key.exact);
+        if (it != by_exact.end()) {
+            it->second->result = result;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        lru.push_front({key, result});
+        by_exact[key.exact] = lru.begin();
+        for (int band = 0; band < kBands; ++band) by_band[band].emplace(band_value(key.simhash, band), lru.begin());
+        if (lru.size() > capacity) evict_locked(std::prev(lru.end()));
+    }
+
+    void evict_locked(EntryList::iterator victim) {
+        for (int band = 0; band < kBands; ++band) {
+            auto range = by_band[band].equal_range(band_value(victim->key.simhash, band));
+            for (auto b = range.first; b != range.second; ++b) {
+                if (b->second == victim) {
+                    by_band[band].erase(b);
+                    break;
+                }
+            }
+        }
+        by_exact.erase(victim->key.exact);
+        lru.erase(victim);
+    }
+
+    const size_t capacity;
+    const int max_distance;
+    mutable std::mutex mutex;
+    EntryList lru;
+    std::unordered_map<uint64_t, EntryList::iterator> by_exact;
+    std::unordered_multimap<uint8_t, EntryList::iterator> by_band[kBands];
+    Stats stats;
+};
@@ -0,0 +1,150 @@
+// detokenizer.h
+// Token-to-text conversion for the persona server's generation loop.
+//
+// PieceTable renders every vocabulary entry once at startup into a single
+// contiguous buffer, so converting a sampled token is an offset lookup
+// instead of a llama_token_to_piece call. Detokenizer appends pieces to a
+// buffer that is reserved up front and reused across requests. It holds back
+// a UTF-8 sequence that a byte-fallback token split across several tokens,
+// so the text it hands out is always valid UTF-8.
+
+#pragma once
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class PieceTable {
+public:
+    explicit PieceTable(const llama_vocab* vocab) {
+        const int32_t n_tokens = llama_vocab_n_tokens(vocab);
+        offsets.reserve(n_tokens + 1);
+        offsets.push_back(0);
+        std::vector<char> buf(256);
+        for (llama_token t = 0; t < n_tokens; ++t) {
+            int n = llama_token_to_piece(vocab, t, buf.data(), (int)buf.size(), 0, false);
+            if (n < 0) {
+                // Buffer too small; -n is the size needed
+                buf.resize(-n);
+                n = llama_token_to_piece(vocab, t, buf.data(), (int)buf.size(), 0, false);
+                if (n < 0) throw std::runtime_error("Failed to render token " + std::to_string(t));
+            }
+            pieces.append(buf.data(), n);
+            offsets.push_back((uint32_t)pieces.size());
+        }
+        pieces.shrink_to_fit();
+    }
+
+    // Empty for control tokens and ids outside the vocabulary
+    std::string_view piece(llama_token t) const {
+        if (t < 0 || (size_t)t + 1 >= offsets.size()) return {};
+        return std::string_view(pieces.data() + offsets[t], offsets[t + 1] - offsets[t]);
+    }
+
+    size_t n_tokens() const { return offsets.size() - 1; }
+    size_t bytes() const { return pieces.size() + offsets.size() * sizeof(uint32_t); }
+
+private:
+    std::string pieces;
+    std::vector<uint32_t> offsets;  // piece t is [offsets[t], offsets[t + 1])
+};
+
+class Detokenizer {
+public:
+    // Clears the text, keeping (and growing to at least) the reserved capacity
+    void reset(size_t reserve_bytes) {
+        buffer.clear();
+        buffer.reserve(reserve_bytes);
+        complete = 0;
+    }
+
+    // Appends a token's piece and returns the text that became complete,
+    // which may be empty while a multi-byte character is still partial.
+    // The view stays valid until the next push.
+    std::string_view push(const PieceTable& table, llama_token t) {
+        const size_t before = buffer.size();
+        buffer.append(table.piece(t));
+        const size_t from = complete;
+        bool replaced = false;
+        complete = complete_prefix(buffer, complete, &replaced);
+        last_verbatim = from == before && complete == buffer.size() && !replaced;
+        return std::string_view(buffer).substr(from, complete - from);
+    }
+
+    // Whether the last push handed out exactly the token's piece: nothing
+    // held back from before or after it, and no bytes replaced
+    bool verbatim() const { return last_verbatim; }
+
+    // Appends text that didn't come from a token, e.g. fixed template text
+    void append(std::string_view text) {
+        buffer.append(text);
+        complete = complete_prefix(buffer, complete);
+    }
+
+    // The text so far, without a trailing partial character
+    std::string_view text() const { return std::string_view(buffer).substr(0, complete); }
+
+    // Bytes held back waiting for the rest of a character
+    size_t pending() const { return buffer.size() - complete; }
+
+    // Cuts the text back to n bytes, e.g. where a stop string begins
+    void truncate(size_t n) {
+        buffer.resize(std::min(n, buffer.size()));
+        complete = std::min(complete, buffer.size());
+    }
+
+private:
+    // Advances past every complete character from `from` on and returns the
+    // end of the last one. Invalid bytes are replaced with U+FFFD in place,
+    // since the text ends up in JSON responses, which must be valid UTF-8.
+    // Byte-fallback tokens can produce any byte, so besides the lead and
+    // continuation bytes this rejects overlong forms (C0, C1, E0 80-9F,
+    // F0 80-8F), surrogates (ED A0-BF) and code points past U+10FFFF
+    // (F4 90-BF, F5-FF), which is what the JSON encoder checks.
+    static size_t complete_prefix(std::string& s, size_t from, bool* replaced = nullptr) {
+        size_t i = from;
+        while (i < s.size()) {
+            const unsigned char c = s[i];
+            size_t len = 0;                     // 0 = not a lead byte
+            unsigned char lo = 0x80, hi = 0xBF; // allowed range of the second byte
+            if (c < 0x80) {
+                len = 1;
+            } else if (c >= 0xC2 && c <= 0xDF) {
+                len = 2;
+            } else if (c >= 0xE0 && c <= 0xEF) {
+                len = 3;
+                if (c == 0xE0) lo = 0xA0;
+                if (c == 0xED) hi = 0x9F;
+            } else if (c >= 0xF0 && c <= 0xF4) {
+                len = 4;
+                if (c == 0xF0) lo = 0x90;
+                if (c == 0xF4) hi = 0x8F;
+            }
+            size_t k = 1;
+            for (; k < len && i + k < s.size(); ++k) {
+                const unsigned char b = s[i + k];
+                if (k == 1 ? (b < lo || b > hi) : (b & 0xC0) != 0x80) break;
+            }
+            if (len == 0 || (k < len && i + k < s.size())) {
+                // Bad lead byte, or a sequence broken off by a byte that
+                // can't continue it: replace what was read of it
+                s.replace(i, k, "\xEF\xBF\xBD");
+                if (replaced) *replaced = true;
+                i += 3;
+                continue;
+            }
+            if (k < len) break;     // wait for the rest
+            i += len;
+        }
+        return i;
+    }
+
+    std::string buffer;
+    size_t complete = 0;    // buffer[0, complete) is safe to hand out
+    bool last_verbatim = true;
+};
@@ -0,0 +1,240 @@
+// document_fingerprint.h
+// Template fingerprints for PDF attachments. Much of what arrives is
+// generated from a handful of templates (one vendor's invoices, a popular
+// CV builder), and documents from the same template look alike on the page
+// and carry the same producer, page size and fonts. A fingerprint is:
+//   - layout: hash of the normalised producer/creator strings, the page
+//     size in points and the sorted set of font names
+//   - dhash: 64-bit difference hash of a thumbnail of the first page, which
+//     stays within a few bits across documents with the same layout
+// TemplateCache clusters fingerprints (same layout, dhash within a few
+// bits) and remembers what the vision model concluded about each cluster,
+// so a template that has only ever produced non-CVs is rejected without
+// running the model.
+
+#pragma once
+
+#include "image_preprocess.h"
+#include "request_capture.h"   // fnv1a64
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DocumentFingerprint {
+    uint64_t layout = 0;
+    uint64_t dhash = 0;
+};
+
+// Difference hash: the page is reduced to 9x8 gray and each bit says
+// whether a pixel is brighter than its right-hand neighbour
+inline uint64_t page_dhash(const PageBitmap& page) {
+    PreprocessConfig thumb;
+    thumb.width = 9;
+    thumb.height = 8;
+    thumb.crop = false;
+    PixelImage img = preprocess_page(page, thumb);
+    auto gray = [&](int x, int y) {
+        const uint8_t* p = &img.data[((size_t)y * img.width + x) * img.channels];
+        return img.channels == 1 ? p[0] : (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+    };
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            if (gray(x, y) > gray(x + 1, y)) hash |= 1ULL << (y * 8 + x);
+        }
+    }
+    return hash;
+}
+
+namespace document_fingerprint_detail {
+
+// Lower case with digit runs collapsed, so "Skia/PDF m120" and "m121" match
+inline std::string normalize_tool(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (std::isdigit(c)) {
+            out += '#';
+            while (i + 1 < s.size() && std::isdigit((unsigned char)s[i + 1])) ++i;
+            continue;
+        }
+        out += (char)std::tolower(c);
+    }
+    return out;
+}
+
+// Subset fonts are named "ABCDEF+Calibri"; the tag differs per document
+inline std::string strip_subset_tag(const std::string& name) {
+    if (name.size() > 7 && name[6] == '+' &&
+        std::all_of(name.begin(), name.begin() + 6, [](char c) { return c >= 'A' && c <= 'Z'; })) {
+        return name.substr(7);
+    }
+    return name;
+}
+
+}  // namespace document_fingerprint_detail
+
+inline uint64_t layout_hash(const std::string& producer, const std::string& creator, double width_pt,
+                            double height_pt, std::vector<std::string> fonts) {
+    using namespace document_fingerprint_detail;
+    for (auto& f : fonts) f = strip_subset_tag(f);
+    std::sort(fonts.begin(), fonts.end());
+    fonts.erase(std::unique(fonts.begin(), fonts.end()), fonts.end());
+
+    std::string key = normalize_tool(producer) + "\n" + normalize_tool(creator) + "\n" +
+                      std::to_string((long)(width_pt + 0.5)) + "x" + std::to_string((long)(height_pt + 0.5));
+    for (const auto& f : fonts) key += "\n" + f;
+    return fnv1a64(key.data(), key.size());
+}
+
+// LRU of template clusters with the CV outcomes seen for each. Thread-safe.
+// Capacity 0 disables it.
+class TemplateCache {
+public:
+    enum class Verdict { Unknown, NotCv };
+
+    struct Stats {
+        size_t templates = 0;
+        size_t capacity = 0;
+        uint64_t matched = 0;       // fingerprints that joined an existing cluster
+        uint64_t created = 0;
+        uint64_t rejected = 0;      // attachments skipped as known non-CV
+    };
+
+    // max_distance: dhash bits that may differ within a cluster.
+    // min_observations: non-CV outcomes (and no CV outcome) before a cluster
+    // is rejected. Every recheck_every-th rejection still goes to the model,
+    // so a verdict that has gone stale is noticed.
+    TemplateCache(size_t capacity, int max_distance, uint32_t min_observations, uint32_t recheck_every = 20)
+        : capacity(capacity), max_distance(max_distance), min_observations(std::max(min_observations, 1u)),
+          recheck_every(recheck_every) {}
+
+    bool enabled() const { return capacity > 0; }
+
+    // The cluster a fingerprint belongs to, created if there is none
+    uint64_t assign(const DocumentFingerprint& fp) {
+        if (!enabled()) return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = by_layout.equal_range(fp.layout);
+        for (auto it = range.first; it != range.second; ++it) {
+            Template& t = *it->second;
+            if (__builtin_popcountll(t.fp.dhash ^ fp.dhash) <= max_distance) {
+                lru.splice(lru.begin(), lru, it->second);
+                ++stats.matched;
+                return t.id;
+            }
+        }
+        ++stats.created;
+        return insert_locked(fp, 0, 0);
+    }
+
+    Verdict cv_verdict(uint64_t id) {
+        if (!enabled()) return Verdict::Unknown;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_id.find(id);
+        if (it == by_id.end()) return Verdict::Unknown;
+        Template& t = *it->second;
+        if (t.cv > 0 || t.not_cv < min_observations) return Verdict::Unknown;
+        if (recheck_every > 0 && ++t.skipped % recheck_every == 0) return Verdict::Unknown;
+        ++stats.rejected;
+        return Verdict::NotCv;
+    }
+
+    void record_cv(uint64_t id, bool is_cv) {
+        if (!enabled()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_id.find(id);
+        if (it == by_id.end()) return;
+        ++(is_cv ? it->second->cv : it->second->not_cv);
+    }
+
+    Stats snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s = stats;
+        s.templates = lru.size();
+        s.capacity = capacity;
+        return s;
+    }
+
+    // Text file, one cluster per line, most recently used last:
+    //   layout<TAB>dhash<TAB>cv<TAB>not_cv
+    void load(const std::string& path) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        unsigned long long layout, dhash;
+        unsigned cv, not_cv;
+        size_t n = 0;
+        while (fscanf(f, "%llx\t%llx\t%u\t%u\n", &layout, &dhash, &cv, &not_cv) == 4) {
+            insert_locked({layout, dhash}, cv, not_cv);
+            ++n;
+        }
+        fclose(f);
+        std::cout << "[TEMPLATE] Loaded " << n << " templates from " << path << std::endl;
+    }
+
+    void save(const std::string& path) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f) throw std::runtime_error("Cannot write template cache: " + tmp);
+        for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+            fprintf(f, "%016llx\t%016llx\t%u\t%u\n", (unsigned long long)it->fp.layout,
+                    (unsigned long long)it->fp.dhash, it->cv, it->not_cv);
+        }
+        if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot write template cache: " + path);
+        }
+        std::cout << "[TEMPLATE] Saved " << lru.size() << " templates to " << path << std::endl;
+    }
+
+private:
+    struct Template {
+        uint64_t id;
+        DocumentFingerprint fp;     // of the cluster's first document
+        uint32_t cv = 0;
+        uint32_t not_cv = 0;
+        uint32_t skipped = 0;
+    };
+
+    uint64_t insert_locked(const DocumentFingerprint& fp, uint32_t cv, uint32_t not_cv) {
+        uint64_t id = fnv1a64(&fp.dhash, sizeof(fp.dhash), fnv1a64(&fp.layout, sizeof(fp.layout)));
+        if (id == 0) id = 1;    // 0 means "no template" to callers
+        if (by_id.count(id)) return id;
+        lru.push_front({id, fp, cv, not_cv, 0});
+        by_id[id] = lru.begin();
+        by_layout.emplace(fp.layout, lru.begin());
+        while (lru.size() > capacity) {
+            const Template& old = lru.back();
+            auto range = by_layout.equal_range(old.fp.layout);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second->id == old.id) {
+                    by_layout.erase(it);
+                    break;
+                }
+            }
+            by_id.erase(old.id);
+            lru.pop_back();
+        }
+        return id;
+    }
+
+    const size_t capacity;
+    const int max_distance;
+    const uint32_t min_observations;
+    const uint32_t recheck_every;
+    std::list<Template> lru;
+    std::unordered_map<uint64_t, std::list<Template>::iterator> by_id;
+    std::unordered_multimap<uint64_t, std::list<Template>::iterator> by_layout;
+    mutable std::mutex mutex;
+    Stats stats;
+};
@@ -0,0 +1,307 @@
+// email_thread.h
+// Trims reply chains before they are prefilled. Bodies sent to /draft-reply
+// and /classify often carry the whole quoted history, which the model has
+// already seen for earlier messages. trim_email_body keeps the new message,
+// drops the history below the first reply header ("On ... wrote:",
+// "-----Original Message-----", Outlook "From:/Sent:" blocks), signatures,
+// "Sent from my ..." lines and legal disclaimers, and replaces the history
+// with a short excerpt of the message being replied to. Forwarded messages
+// are kept, since they are what the sender is passing on. The new message is
+// never cut; the token budget (estimated at 4 bytes per token) only limits
+// how much of the history is kept alongside it.
+//
+// Lines are found with memchr, which glibc vectorises, so a long thread is
+// scanned in a single pass over the bytes. The line lists and joined text
+// are scratch and come from the caller's memory resource (a RequestArena in
+// the server).
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ThreadTrimConfig {
+    bool enabled = true;
+    size_t token_budget = 1024;     // for the whole trimmed body, 0 = no limit; only history is cut to fit
+    size_t parent_tokens = 256;     // excerpt of the message replied to, 0 = none
+};
+
+struct TrimmedBody {
+    std::string text;
+    size_t earlier_messages = 0;    // reply headers found in the dropped history
+    size_t dropped_lines = 0;
+    bool truncated = false;         // parent excerpt cut or left out for the token budget
+};
+
+namespace email_thread_detail {
+
+constexpr size_t kBytesPerToken = 4;
+
+using Lines = std::pmr::vector<std::string_view>;
+
+inline Lines split_lines(const std::string& text, std::pmr::memory_resource* mr) {
+    Lines lines(mr);
+    const char* p = text.data();
+    const char* end = p + text.size();
+    while (p < end) {
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* line_end = nl ? nl : end;
+        size_t n = line_end - p;
+        if (n > 0 && p[n - 1] == '\r') --n;
+        lines.emplace_back(p, n);
+        p = nl ? nl + 1 : end;
+    }
+    return lines;
+}
+
+inline std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+inline bool iequals_at(std::string_view s, size_t pos, std::string_view word) {
+    if (pos + word.size() > s.size()) return false;
+    for (size_t i = 0; i < word.size(); ++i) {
+        if (std::tolower((unsigned char)s[pos + i]) != word[i]) return false;
+    }
+    return true;
+}
+
+inline bool istarts_with(std::string_view s, std::string_view word) { return iequals_at(s, 0, word); }
+
+inline bool iends_with(std::string_view s, std::string_view word) {
+    return s.size() >= word.size() && iequals_at(s, s.size() - word.size(), word);
+}
+
+inline bool icontains(std::string_view s, std::string_view word) {
+    for (size_t i = 0; i + word.size() <= s.size(); ++i) {
+        if (iequals_at(s, i, word)) return true;
+    }
+    return false;
+}
+
+inline size_t quote_depth(std::string_view line) {
+    size_t depth = 0;
+    for (char c : line) {
+        if (c == '>') ++depth;
+        else if (c != ' ' && c != '\t') break;
+    }
+    return depth;
+}
+
+inline std::string_view unquote(std::string_view line) {
+    line = trim(line);
+    while (!line.empty() && (line.front() == '>' || line.front() == ' ')) line.remove_prefix(1);
+    return line;
+}
+
+// "On Mon, 3 Jun 2024 at 10:12, Anna <anna@example.com> wrote:" and its
+// usual translations
+inline bool is_attribution(std::string_view line) {
+    line = trim(line);
+    return line.size() <= 300 &&
+           (iends_with(line, "wrote:") || iends_with(line, "a écrit :") || iends_with(line, "a écrit:") ||
+            iends_with(line, "schrieb:") || iends_with(line, "ha scritto:") || iends_with(line, "escribió:") ||
+            iends_with(line, "geschreven:"));
+}
+
+// "---------- Forwarded message ---------" (Gmail) or "Begin forwarded
+// message:" (Apple Mail)
+inline bool is_forward_marker(std::string_view line) {
+    line = trim(line);
+    return (!line.empty() && line.front() == '-' && icontains(line, "forwarded message")) ||
+           istarts_with(line, "begin forwarded message");
+}
+
+// An attribution line, an "Original Message" rule, or an Outlook header
+// block ("From:" followed closely by "Sent:"/"Date:"). A forwarded message
+// is content the sender wants read, not history: forward markers are not
+// reply headers, and neither is the From:/Date: block just below one.
+inline bool is_reply_header(const Lines& lines, size_t i) {
+    std::string_view line = trim(lines[i]);
+    if (line.empty() || line.size() > 300) return false;
+    if (is_attribution(line)) return true;
+    if (line.front() == '-' && icontains(line, "original message")) return true;
+    if (istarts_with(line, "from:")) {
+        size_t prev = i;
+        while (prev > 0 && trim(lines[prev - 1]).empty()) --prev;
+        if (prev > 0 && is_forward_marker(lines[prev - 1])) return false;
+        for (size_t j = i + 1; j < lines.size() && j <= i + 4; ++j) {
+            std::string_view next = trim(lines[j]);
+            if (istarts_with(next, "sent:") || istarts_with(next, "date:")) return true;
+        }
+    }
+    return false;
+}
+
+// An attribution followed by text interleaved with the quotes is an
+// inline reply: the new message lives inside the quoted block, so keep it
+inline bool is_inline_reply(const Lines& lines, size_t header) {
+    bool seen_quote = false;
+    for (size_t j = header + 1; j < lines.size(); ++j) {
+        if (is_reply_header(lines, j)) break;
+        std::string_view line = trim(lines[j]);
+        if (line.empty()) continue;
+        if (line.front() == '>') {
+            seen_quote = true;
+        } else if (seen_quote) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool is_signature_rule(std::string_view line) { return line == "-- " || line == "--"; }
+
+// "________________________________" above Outlook headers and the like
+inline bool is_separator(std::string_view line) {
+    line = trim(line);
+    return line.size() >= 10 && line.find_first_not_of(line.front()) == std::string_view::npos &&
+           (line.front() == '_' || line.front() == '-' || line.front() == '=');
+}
+
+inline bool is_disclaimer(std::string_view paragraph) {
+    return icontains(paragraph, "intended recipient") || icontains(paragraph, "intended solely") ||
+           istarts_with(trim(paragraph), "confidential") || istarts_with(trim(paragraph), "disclaimer");
+}
+
+// Appends at most max_bytes of text, cut at a space and never inside a
+// UTF-8 sequence. Returns false if text had to be cut.
+inline bool append_limited(std::string& out, std::string_view text, size_t max_bytes) {
+    if (text.size() <= max_bytes) {
+        out.append(text);
+        return true;
+    }
+    size_t cut = max_bytes;
+    while (cut > 0 && ((unsigned char)text[cut] & 0xC0) == 0x80) --cut;
+    size_t space = text.rfind(' ', cut);
+    if (space != std::string_view::npos && space > cut / 2) cut = space;
+    out.append(text.substr(0, cut));
+    out.append(" [...]");
+    return false;
+}
+
+// Joins lines, dropping runs of blank lines
+inline std::pmr::string join_lines(const Lines& lines) {
+    std::pmr::string out(lines.get_allocator());
+    bool blank = false;
+    for (std::string_view line : lines) {
+        if (trim(line).empty()) {
+            blank = !out.empty();
+            continue;
+        }
+        if (!out.empty()) out += blank ? "\n\n" : "\n";
+        blank = false;
+        out.append(line);
+    }
+    return out;
+}
+
+}  // namespace email_thread_detail
+
+inline TrimmedBody trim_email_body(const std::string& body, const ThreadTrimConfig& config,
+                                   std::pmr::memory_resource* scratch = std::pmr::get_default_resource()) {
+    using namespace email_thread_detail;
+    TrimmedBody result;
+    if (!config.enabled) {
+        result.text = body;
+        return result;
+    }
+    const Lines lines = split_lines(body, scratch);
+
+    // Where the quoted history starts
+    size_t history = lines.size();
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (!is_reply_header(lines, i)) continue;
+        if (is_attribution(lines[i]) && is_inline_reply(lines, i)) continue;
+        history = i;
+        break;
+    }
+    for (size_t i = history; i < lines.size(); ++i) {
+        if (is_reply_header(lines, i)) ++result.earlier_messages;
+    }
+
+    // The new message: no signature, device footers, nested quotes or disclaimers
+    size_t end = history;
+    for (size_t i = 0; i < history; ++i) {
+        if (is_signature_rule(lines[i])) {
+            end = i;
+            break;
+        }
+    }
+    Lines kept(scratch);
+    for (size_t i = 0; i < end;) {
+        // Work paragraph by paragraph so disclaimers go as a whole
+        size_t j = i;
+        while (j < end && !trim(lines[j]).empty()) ++j;
+        if (j > i) {
+            std::string_view paragraph(lines[i].data(), lines[j - 1].data() + lines[j - 1].size() - lines[i].data());
+            if (is_disclaimer(paragraph)) {
+                result.dropped_lines += j - i;
+                i = j;
+                continue;
+            }
+        }
+        for (; i < j; ++i) {
+            if (istarts_with(trim(lines[i]), "sent from my ") || quote_depth(lines[i]) > 1 ||
+                is_separator(lines[i])) {
+                ++result.dropped_lines;
+                continue;
+            }
+            kept.push_back(lines[i]);
+        }
+        for (; i < end && trim(lines[i]).empty(); ++i) kept.push_back(lines[i]);
+    }
+    result.dropped_lines += lines.size() - end;
+    std::pmr::string message = join_lines(kept);
+    if (message.empty()) {
+        // Nothing recognisable as a new message (e.g. a bare forward): keep it all
+        message = join_lines(lines);
+        result.dropped_lines = 0;
+        result.earlier_messages = 0;
+        history = lines.size();
+    }
+
+    result.text.assign(message.data(), message.size());
+    if (history == lines.size()) return result;
+
+    // A short excerpt of the message being replied to, which the draft needs
+    std::pmr::string parent(scratch);
+    if (config.parent_tokens > 0) {
+        size_t i = history + 1;
+        // Skip the rest of an Outlook header block
+        if (!is_attribution(lines[history])) {
+            while (i < lines.size() && !trim(lines[i]).empty()) ++i;
+        }
+        Lines parent_lines(scratch);
+        for (; i < lines.size(); ++i) {
+            if (is_reply_header(lines, i)) break;
+            std::string_view line = unquote(lines[i]);
+            if (is_signature_rule(line)) break;
+            parent_lines.push_back(line);
+        }
+        parent = join_lines(parent_lines);
+    }
+
+    const size_t budget = config.token_budget ? config.token_budget * kBytesPerToken : std::string::npos;
+    const size_t used = result.text.size();
+    std::string note = "\n\n[" + std::to_string(result.earlier_messages) + " earlier message" +
+                       (result.earlier_messages == 1 ? "" : "s") + " in this thread omitted";
+    if (!parent.empty() && used < budget) {
+        result.text += note + ". The message being replied to began:]\n";
+        size_t room = std::min(config.parent_tokens * kBytesPerToken,
+                               budget == std::string::npos ? std::string::npos : budget - used);
+        result.truncated = !append_limited(result.text, parent, room);
+    } else {
+        result.truncated = !parent.empty();
+        result.text += note + "]";
+    }
+    return result;
+}
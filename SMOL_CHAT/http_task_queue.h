@@ -0,0 +1,142 @@
+// http_task_queue.h
+// Connection task queue for httplib::Server that grows with demand.
+//
+// httplib hands each accepted connection to its task queue and the handler
+// runs on that thread until the response is written, so a fixed pool is
+// exhausted by long inference calls and /health, /metrics then sit in the
+// queue behind them. This pool keeps min_threads warm and starts another
+// thread whenever a connection arrives with no idle worker to take it (up
+// to max_threads), so cheap endpoints are always served promptly. Threads
+// that are blocked waiting on the inference scheduler cost only a stack;
+// extra threads exit again after idle_timeout.
+
+#pragma once
+
+#include "httplib.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ElasticTaskQueue : public httplib::TaskQueue {
+public:
+    struct Stats {
+        size_t threads = 0;
+        size_t idle = 0;
+        size_t queued = 0;          // connections waiting for a thread
+        size_t peak_threads = 0;
+        size_t min_threads = 0;
+        size_t max_threads = 0;
+        size_t connections = 0;     // accepted since start
+    };
+
+    ElasticTaskQueue(size_t min_threads, size_t max_threads,
+                     std::chrono::milliseconds idle_timeout = std::chrono::seconds(30))
+        : min_threads(std::max<size_t>(1, min_threads)),
+          max_threads(std::max(this->min_threads, max_threads)),
+          idle_timeout(idle_timeout) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < this->min_threads; ++i) spawn_locked();
+    }
+
+    ~ElasticTaskQueue() override { shutdown(); }
+
+    ElasticTaskQueue(const ElasticTaskQueue&) = delete;
+    ElasticTaskQueue& operator=(const ElasticTaskQueue&) = delete;
+
+    void enqueue(std::function<void()> fn) override {
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            jobs.push_back(std::move(fn));
+            ++accepted;
+            if (jobs.size() > idle && workers.size() < max_threads) spawn_locked();
+            finished.swap(exited);
+        }
+        cv.notify_one();
+        for (auto& t : finished) t.join();
+    }
+
+    void shutdown() override {
+        std::vector<std::thread> to_join;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto& [id, t] : workers) to_join.push_back(std::move(t));
+            workers.clear();
+            for (auto& t : exited) to_join.push_back(std::move(t));
+            exited.clear();
+        }
+        cv.notify_all();
+        for (auto& t : to_join) {
+            if (t.joinable()) t.join();
+        }
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s;
+        s.threads = workers.size();
+        s.idle = idle;
+        s.queued = jobs.size();
+        s.peak_threads = peak;
+        s.min_threads = min_threads;
+        s.max_threads = max_threads;
+        s.connections = accepted;
+        return s;
+    }
+
+private:
+    void spawn_locked() {
+        std::thread t([this] { worker_loop(); });
+        workers.emplace(t.get_id(), std::move(t));
+        peak = std::max(peak, workers.size());
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            ++idle;
+            bool woke = cv.wait_for(lock, idle_timeout, [this] { return stopping || !jobs.empty(); });
+            --idle;
+            if (stopping && jobs.empty()) return;
+            if (!woke) {
+                // Idle for a while: give the thread back unless we're at the floor
+                if (workers.size() > min_threads) {
+                    auto it = workers.find(std::this_thread::get_id());
+                    exited.push_back(std::move(it->second));
+                    workers.erase(it);
+                    return;
+                }
+                continue;
+            }
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    const size_t min_threads;
+    const size_t max_threads;
+    const std::chrono::milliseconds idle_timeout;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+    std::map<std::thread::id, std::thread> workers;
+    std::vector<std::thread> exited;    // returned on idle, joined on the next enqueue
+    size_t idle = 0;
+    size_t peak = 0;
+    size_t accepted = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,114 @@
+// http_tuning.h
+// Connection and payload settings shared by the persona and CV servers:
+// keep-alive limits, TCP_NODELAY, gzip for large responses and request body
+// limits per endpoint.
+
+#pragma once
+
+#include "httplib.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+struct HttpTuning {
+    size_t keep_alive_max_count = 100;      // requests per connection
+    time_t keep_alive_timeout_sec = 5;
+    bool tcp_nodelay = true;
+    size_t gzip_min_bytes = 4096;           // 0 disables compression
+    size_t default_body_limit = 1024 * 1024;
+    std::map<std::string, size_t> body_limits;  // path -> max request body
+
+    // "--body-limit-kb /ai/inbox/draft-reply=2048"
+    void set_body_limit(const std::string& spec) {
+        size_t eq = spec.find('=');
+        if (eq == std::string::npos || eq == 0) {
+            throw std::runtime_error("Invalid --body-limit-kb (expected PATH=KB): " + spec);
+        }
+        body_limits[spec.substr(0, eq)] = std::stoul(spec.substr(eq + 1)) * 1024;
+    }
+
+    size_t body_limit(const std::string& path) const {
+        auto it = body_limits.find(path);
+        return it != body_limits.end() ? it->second : default_body_limit;
+    }
+
+    size_t max_body_limit() const {
+        size_t limit = default_body_limit;
+        for (const auto& [path, bytes] : body_limits) limit = std::max(limit, bytes);
+        return limit;
+    }
+};
+
+// gzip-compresses body; returns false (leaving out untouched) on failure
+inline bool gzip_compress(const std::string& body, std::string& out) {
+    z_stream zs{};
+    // 15 window bits + 16 selects the gzip wrapper instead of raw zlib
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    std::string compressed(deflateBound(&zs, body.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+    zs.avail_in = static_cast<uInt>(body.size());
+    zs.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    zs.avail_out = static_cast<uInt>(compressed.size());
+    int ret = deflate(&zs, Z_FINISH);
+    compressed.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) return false;
+    out.swap(compressed);
+    return true;
+}
+
+inline bool accepts_gzip(const httplib::Request& req) {
+    return req.get_header_value("Accept-Encoding").find("gzip") != std::string::npos;
+}
+
+inline void apply_http_tuning(httplib::Server& svr, const HttpTuning& tuning) {
+    svr.set_keep_alive_max_count(tuning.keep_alive_max_count);
+    svr.set_keep_alive_timeout(tuning.keep_alive_timeout_sec);
+    svr.set_tcp_nodelay(tuning.tcp_nodelay);
+    // The global cap still applies to chunked bodies without a Content-Length
+    svr.set_payload_max_length(tuning.max_body_limit());
+
+    // Reject oversized bodies from the headers alone, before httplib reads them
+    svr.set_pre_routing_handler([tuning](const httplib::Request& req, httplib::Response& res) {
+        if (!req.has_header("Content-Length")) return httplib::Server::HandlerResponse::Unhandled;
+        const size_t limit = tuning.body_limit(req.path);
+        size_t length = 0;
+        try {
+            length = std::stoull(req.get_header_value("Content-Length"));
+        } catch (const std::exception&) {
+            return httplib::Server::HandlerResponse::Unhandled;   // httplib rejects it itself
+        }
+        if (length <= limit) return httplib::Server::HandlerResponse::Unhandled;
+        res.status = 413;
+        res.set_header("Connection", "close");
+        res.set_content("{\"error\":\"Request body too large for " + req.path + " (limit " +
+                        std::to_string(limit) + " bytes)\"}", "application/json");
+        return httplib::Server::HandlerResponse::Handled;
+    });
+
+    // Compress large responses only; small ones cost more CPU than they save
+    if (tuning.gzip_min_bytes > 0) {
+        const size_t min_bytes = tuning.gzip_min_bytes;
+        svr.set_post_routing_handler([min_bytes](const httplib::Request& req, httplib::Response& res) {
+            if (res.body.size() < min_bytes || res.has_header("Content-Encoding")) return;
+            res.set_header("Vary", "Accept-Encoding");
+            if (!accepts_gzip(req)) return;
+            std::string compressed;
+            if (gzip_compress(res.body, compressed) && compressed.size() < res.body.size()) {
+                res.body.swap(compressed);
+                res.set_header("Content-Encoding", "gzip");
+                // httplib has already set Content-Length by the time this runs
+                res.headers.erase("Content-Length");
+                res.set_header("Content-Length", std::to_string(res.body.size()));
+            }
+        });
+    }
+}
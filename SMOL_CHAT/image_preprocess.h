@@ -0,0 +1,561 @@
+// image_preprocess.h
+// Turns a rendered PDF page into the vision projector's input size
+// in-process, instead of PNG-encoding the full-size page and letting
+// llama-mtmd-cli decode and resize it again.
+//
+// Pages are held as a PageBitmap: BGRA (poppler's ARGB32 on little-endian),
+// 8-bit gray, or 1-bit mono packed 8 pixels per byte. Text documents lose
+// nothing in gray, which is a quarter of the size, and mono is a
+// thirty-second.
+//
+// Pipeline, all in one pass over the source rows:
+//   0. content box: the page is cropped to the area holding ink, plus a
+//      small margin, so the encoder's fixed resolution goes to text rather
+//      than white paper (SIMD row scan)
+//   1. vertical area resample: weighted sum of source rows, widened from
+//      u8 to f32 (the bulk of the work; SIMD). Mono rows are unpacked to
+//      0/255 bytes through a lookup table first.
+//   2. horizontal area resample, reordering BGRA to RGB
+//   3. either round back to u8 for a PPM/PGM file the CLI loads without
+//      decompression (SIMD), or mean/std-normalize into planar f32 (SIMD)
+//      for callers that feed the projector directly
+//
+// Kernels exist for AVX-512, AVX2+FMA and NEON, plus a scalar fallback; the
+// x86 ones are compiled with target attributes and picked at runtime, so no
+// build flags are needed.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_PREPROCESS_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define IMAGE_PREPROCESS_NEON 1
+#endif
+
+struct PreprocessConfig {
+    int width = 896;    // Gemma 3 vision encoder input
+    int height = 896;
+    float mean[3] = {0.5f, 0.5f, 0.5f};
+    float std[3] = {0.5f, 0.5f, 0.5f};
+    bool crop = true;           // crop to the content box before resizing
+    int crop_threshold = 224;   // gray level below which a pixel is content
+    float crop_margin = 0.02f;  // kept around the content, fraction of the page size
+};
+
+struct Region {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+enum class PixelFormat { Bgra, Gray, Mono };
+
+struct PageBitmap {
+    PixelFormat format = PixelFormat::Bgra;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;          // bytes per row
+    std::vector<uint8_t> data;  // Mono: most significant bit first, 1 = white
+
+    size_t bytes() const { return data.size(); }
+};
+
+// Output of the resize: interleaved RGB, or gray when channels == 1
+struct PixelImage {
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    std::vector<uint8_t> data;
+    Region source;              // part of the page that was resized
+};
+
+namespace image_preprocess_detail {
+
+// ---- kernels ---------------------------------------------------------------
+
+struct Kernels {
+    const char* name;
+    // dst[i] += w * src[i]
+    void (*accumulate_u8)(float* dst, const uint8_t* src, float w, size_t n);
+    // dst[i] = clamp(round(src[i]), 0, 255)
+    void (*to_u8)(const float* src, uint8_t* dst, size_t n);
+    // p[i] = p[i] * scale + bias
+    void (*scale_bias)(float* p, size_t n, float scale, float bias);
+    // Indices of the first and last byte below threshold; false if none
+    bool (*dark_extent)(const uint8_t* p, size_t n, uint8_t threshold, size_t* first, size_t* last);
+};
+
+inline void accumulate_u8_scalar(float* dst, const uint8_t* src, float w, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] += w * src[i];
+}
+
+inline void to_u8_scalar(const float* src, uint8_t* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] = (uint8_t)std::min(255.0f, std::max(0.0f, std::nearbyint(src[i])));
+}
+
+inline void scale_bias_scalar(float* p, size_t n, float scale, float bias) {
+    for (size_t i = 0; i < n; ++i) p[i] = p[i] * scale + bias;
+}
+
+inline bool dark_extent_scalar(const uint8_t* p, size_t n, uint8_t threshold, size_t* first, size_t* last) {
+    size_t i = 0;
+    while (i < n && p[i] >= threshold) ++i;
+    if (i == n) return false;
+    *first = i;
+    size_t j = n - 1;
+    while (p[j] >= threshold) --j;
+    *last = j;
+    return true;
+}
+
+#if IMAGE_PREPROCESS_X86
+__attribute__((target("avx2,fma")))
+inline void accumulate_u8_avx2(float* dst, const uint8_t* src, float w, size_t n) {
+    const __m256 vw = _mm256_set1_ps(w);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 s = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(s, vw, _mm256_loadu_ps(dst + i)));
+    }
+    accumulate_u8_scalar(dst + i, src + i, w, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline void to_u8_avx2(const float* src, uint8_t* dst, size_t n) {
+    const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(src + i)));
+        __m256i i32 = _mm256_cvtps_epi32(v);
+        __m128i i16 = _mm_packus_epi32(_mm256_castsi256_si128(i32), _mm256_extracti128_si256(i32, 1));
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(i16, i16));
+    }
+    to_u8_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline void scale_bias_avx2(float* p, size_t n, float scale, float bias) {
+    const __m256 vs = _mm256_set1_ps(scale), vb = _mm256_set1_ps(bias);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(p + i, _mm256_fmadd_ps(_mm256_loadu_ps(p + i), vs, vb));
+    scale_bias_scalar(p + i, n - i, scale, bias);
+}
+
+// Blank paper is the common case, so whole 32-byte blocks are tested and
+// only a block holding ink is looked at byte by byte
+__attribute__((target("avx2")))
+inline bool dark_extent_avx2(const uint8_t* p, size_t n, uint8_t threshold, size_t* first, size_t* last) {
+    if (threshold == 0) return false;
+    const __m256i limit = _mm256_set1_epi8((char)(threshold - 1));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v));
+        if (mask) break;
+    }
+    size_t f, l;
+    if (!dark_extent_scalar(p + i, n - i, threshold, &f, &l)) return false;
+    *first = i + f;
+    size_t j = n;
+    for (; j >= *first + 32; j -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + j - 32));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v));
+        if (mask) {
+            *last = j - 32 + 31 - __builtin_clz(mask);
+            return true;
+        }
+    }
+    dark_extent_scalar(p + *first, j - *first, threshold, &f, &l);
+    *last = *first + l;
+    return true;
+}
+
+__attribute__((target("avx512f")))
+inline void accumulate_u8_avx512(float* dst, const uint8_t* src, float w, size_t n) {
+    const __m512 vw = _mm512_set1_ps(w);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 s = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(src + i))));
+        _mm512_storeu_ps(dst + i, _mm512_fmadd_ps(s, vw, _mm512_loadu_ps(dst + i)));
+    }
+    accumulate_u8_scalar(dst + i, src + i, w, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline void to_u8_avx512(const float* src, uint8_t* dst, size_t n) {
+    const __m512 lo = _mm512_setzero_ps(), hi = _mm512_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_loadu_ps(src + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm512_cvtusepi32_epi8(_mm512_cvtps_epi32(v)));
+    }
+    to_u8_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline void scale_bias_avx512(float* p, size_t n, float scale, float bias) {
+    const __m512 vs = _mm512_set1_ps(scale), vb = _mm512_set1_ps(bias);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(p + i, _mm512_fmadd_ps(_mm512_loadu_ps(p + i), vs, vb));
+    scale_bias_scalar(p + i, n - i, scale, bias);
+}
+#endif
+
+#if IMAGE_PREPROCESS_NEON
+inline void accumulate_u8_neon(float* dst, const uint8_t* src, float w, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t s16 = vmovl_u8(vld1_u8(src + i));
+        float32x4_t s_lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(s16)));
+        float32x4_t s_hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(s16)));
+        vst1q_f32(dst + i, vmlaq_n_f32(vld1q_f32(dst + i), s_lo, w));
+        vst1q_f32(dst + i + 4, vmlaq_n_f32(vld1q_f32(dst + i + 4), s_hi, w));
+    }
+    accumulate_u8_scalar(dst + i, src + i, w, n - i);
+}
+
+inline void to_u8_neon(const float* src, uint8_t* dst, size_t n) {
+    const float32x4_t lo = vdupq_n_f32(0.0f), hi = vdupq_n_f32(255.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vminq_f32(hi, vmaxq_f32(lo, vld1q_f32(src + i)));
+        float32x4_t b = vminq_f32(hi, vmaxq_f32(lo, vld1q_f32(src + i + 4)));
+        // Round to nearest: add 0.5 and truncate (values are non-negative)
+        uint32x4_t ia = vcvtq_u32_f32(vaddq_f32(a, vdupq_n_f32(0.5f)));
+        uint32x4_t ib = vcvtq_u32_f32(vaddq_f32(b, vdupq_n_f32(0.5f)));
+        uint16x8_t i16 = vcombine_u16(vqmovn_u32(ia), vqmovn_u32(ib));
+        vst1_u8(dst + i, vqmovn_u16(i16));
+    }
+    to_u8_scalar(src + i, dst + i, n - i);
+}
+
+inline void scale_bias_neon(float* p, size_t n, float scale, float bias) {
+    const float32x4_t vb = vdupq_n_f32(bias);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) vst1q_f32(p + i, vmlaq_n_f32(vb, vld1q_f32(p + i), scale));
+    scale_bias_scalar(p + i, n - i, scale, bias);
+}
+#endif
+
+#if IMAGE_PREPROCESS_NEON
+inline bool block_has_dark_neon(const uint8_t* p, uint8x16_t threshold) {
+    uint64x2_t m = vreinterpretq_u64_u8(vcltq_u8(vld1q_u8(p), threshold));
+    return (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) != 0;
+}
+
+inline bool dark_extent_neon(const uint8_t* p, size_t n, uint8_t threshold, size_t* first, size_t* last) {
+    const uint8x16_t t = vdupq_n_u8(threshold);
+    size_t i = 0;
+    while (i + 16 <= n && !block_has_dark_neon(p + i, t)) i += 16;
+    size_t f, l;
+    if (!dark_extent_scalar(p + i, n - i, threshold, &f, &l)) return false;
+    *first = i + f;
+    size_t j = n;
+    while (j >= *first + 16 && !block_has_dark_neon(p + j - 16, t)) j -= 16;
+    dark_extent_scalar(p + *first, j - *first, threshold, &f, &l);
+    *last = *first + l;
+    return true;
+}
+#endif
+
+inline const Kernels& scalar_kernels() {
+    static const Kernels k{"scalar", accumulate_u8_scalar, to_u8_scalar, scale_bias_scalar, dark_extent_scalar};
+    return k;
+}
+
+// The widest kernels this CPU supports, detected once
+inline const Kernels& best_kernels() {
+    static const Kernels k = [] {
+#if IMAGE_PREPROCESS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return Kernels{"avx512", accumulate_u8_avx512, to_u8_avx512, scale_bias_avx512, dark_extent_avx2};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return Kernels{"avx2", accumulate_u8_avx2, to_u8_avx2, scale_bias_avx2, dark_extent_avx2};
+        }
+#elif IMAGE_PREPROCESS_NEON
+        return Kernels{"neon", accumulate_u8_neon, to_u8_neon, scale_bias_neon, dark_extent_neon};
+#endif
+        return scalar_kernels();
+    }();
+    return k;
+}
+
+// ---- resampling ------------------------------------------------------------
+
+// Area (box) filter taps: output i averages source [i * s, (i + 1) * s)
+struct Taps {
+    std::vector<int> first;         // first source index per output
+    std::vector<int> count;
+    std::vector<float> weights;     // count[i] weights per output, summing to 1
+    std::vector<size_t> offset;     // into weights
+};
+
+inline Taps area_taps(int src, int dst) {
+    Taps t;
+    const double scale = (double)src / dst;
+    for (int i = 0; i < dst; ++i) {
+        double a = i * scale, b = (i + 1) * scale;
+        if (b - a < 1.0) {
+            // Upscaling: one source pixel per output
+            double c = std::min((a + b) / 2, src - 0.5);
+            a = std::floor(c);
+            b = a + 1;
+        }
+        int first = (int)std::floor(a);
+        int last = std::min(src, (int)std::ceil(b));
+        t.first.push_back(first);
+        t.count.push_back(last - first);
+        t.offset.push_back(t.weights.size());
+        for (int j = first; j < last; ++j) {
+            double overlap = std::min(b, (double)j + 1) - std::max(a, (double)j);
+            t.weights.push_back((float)(overlap / (b - a)));
+        }
+    }
+    return t;
+}
+
+// 256 entries of 8 unpacked pixels, so a mono byte unpacks with one store
+inline const uint64_t* mono_unpack_table() {
+    static const auto table = [] {
+        std::vector<uint64_t> t(256);
+        for (int v = 0; v < 256; ++v) {
+            uint64_t px = 0;
+            for (int bit = 0; bit < 8; ++bit) {
+                if (v & (0x80 >> bit)) px |= 0xFFULL << (bit * 8);   // little-endian byte order
+            }
+            t[v] = px;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+inline void unpack_mono_row(const uint8_t* packed, uint8_t* out, int width) {
+    const uint64_t* table = mono_unpack_table();
+    const int whole = width / 8;
+    for (int i = 0; i < whole; ++i) memcpy(out + i * 8, &table[packed[i]], 8);
+    for (int x = whole * 8; x < width; ++x) out[x] = (packed[x / 8] & (0x80 >> (x % 8))) ? 255 : 0;
+}
+
+// Resamples a region of a page to out_w x out_h, calling emit(y, row) with
+// each output row as interleaved floats in 0..255: RGB for Bgra pages, one
+// gray channel otherwise
+template <typename Emit>
+void resample(const PageBitmap& page, const Region& region, int out_w, int out_h, const Kernels& k, Emit&& emit) {
+    const int channels = page.format == PixelFormat::Bgra ? 4 : 1;
+    const Taps ty = area_taps(region.height, out_h);
+    const Taps tx = area_taps(region.width, out_w);
+    std::vector<float> column((size_t)region.width * channels);
+    std::vector<float> row((size_t)out_w * (channels == 4 ? 3 : 1));
+    std::vector<uint8_t> unpacked(page.format == PixelFormat::Mono ? page.width : 0);
+    auto source_row = [&](int y) -> const uint8_t* {
+        const uint8_t* p = page.data.data() + (size_t)(region.y + y) * page.stride;
+        if (page.format != PixelFormat::Mono) return p + (size_t)region.x * channels;
+        unpack_mono_row(p, unpacked.data(), page.width);
+        return unpacked.data() + region.x;
+    };
+    for (int y = 0; y < out_h; ++y) {
+        std::fill(column.begin(), column.end(), 0.0f);
+        for (int j = 0; j < ty.count[y]; ++j) {
+            k.accumulate_u8(column.data(), source_row(ty.first[y] + j), ty.weights[ty.offset[y] + j], column.size());
+        }
+        for (int x = 0; x < out_w; ++x) {
+            const float* w = &tx.weights[tx.offset[x]];
+            if (channels == 1) {
+                const float* p = &column[tx.first[x]];
+                float v = 0;
+                for (int j = 0; j < tx.count[x]; ++j) v += w[j] * p[j];
+                row[x] = v;
+                continue;
+            }
+            float r = 0, g = 0, b = 0;
+            const float* p = &column[(size_t)tx.first[x] * 4];
+            for (int j = 0; j < tx.count[x]; ++j, p += 4) {
+                b += w[j] * p[0];
+                g += w[j] * p[1];
+                r += w[j] * p[2];
+            }
+            row[x * 3 + 0] = r;
+            row[x * 3 + 1] = g;
+            row[x * 3 + 2] = b;
+        }
+        emit(y, row.data());
+    }
+}
+
+}  // namespace image_preprocess_detail
+
+// Copies a rendered buffer into a PageBitmap, dropping row padding. Bgra
+// and Gray sources are kept as they are; a Gray source packed as Mono is
+// thresholded at `threshold`.
+inline PageBitmap pack_page(const uint8_t* src, int width, int height, size_t src_stride, PixelFormat src_format,
+                            PixelFormat format, int threshold = 128) {
+    if (format != src_format && !(src_format == PixelFormat::Gray && format == PixelFormat::Mono)) {
+        throw std::runtime_error("Unsupported page conversion");
+    }
+    PageBitmap page;
+    page.format = format;
+    page.width = width;
+    page.height = height;
+    page.stride = format == PixelFormat::Bgra ? (size_t)width * 4
+                : format == PixelFormat::Gray ? (size_t)width
+                                              : ((size_t)width + 7) / 8;
+    page.data.resize(page.stride * height);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* in = src + (size_t)y * src_stride;
+        uint8_t* out = page.data.data() + (size_t)y * page.stride;
+        if (format != PixelFormat::Mono) {
+            memcpy(out, in, page.stride);
+            continue;
+        }
+        for (int x = 0; x < width; ++x) {
+            if (in[x] >= threshold) out[x / 8] |= (uint8_t)(0x80 >> (x % 8));
+        }
+        if (width % 8) out[page.stride - 1] |= (uint8_t)(0xFF >> (width % 8));   // padding is white
+    }
+    return page;
+}
+
+inline Region full_page(const PageBitmap& page) { return {0, 0, page.width, page.height}; }
+
+// Bounding box of the pixels darker than `threshold` (any channel, for
+// color pages), or an empty region on a blank page
+inline Region content_box(const PageBitmap& page, int threshold,
+                          const image_preprocess_detail::Kernels& k = image_preprocess_detail::best_kernels()) {
+    // Mono rows hold ink wherever a byte isn't all-white bits
+    const uint8_t limit = page.format == PixelFormat::Mono ? 255 : (uint8_t)std::min(std::max(threshold, 0), 255);
+    const size_t bytes_per_row = page.format == PixelFormat::Bgra ? (size_t)page.width * 4
+                               : page.format == PixelFormat::Gray ? (size_t)page.width
+                                                                  : ((size_t)page.width + 7) / 8;
+    int x0 = page.width, x1 = -1, y0 = -1, y1 = -1;
+    for (int y = 0; y < page.height; ++y) {
+        const uint8_t* row = page.data.data() + (size_t)y * page.stride;
+        size_t first, last;
+        if (!k.dark_extent(row, bytes_per_row, limit, &first, &last)) continue;
+        int left, right;
+        if (page.format == PixelFormat::Bgra) {
+            left = (int)(first / 4);
+            right = (int)(last / 4);
+        } else if (page.format == PixelFormat::Gray) {
+            left = (int)first;
+            right = (int)last;
+        } else {
+            left = (int)first * 8 + __builtin_clz((uint8_t)~row[first]) - 24;
+            right = (int)last * 8 + 7 - __builtin_ctz((uint8_t)~row[last]);
+        }
+        x0 = std::min(x0, left);
+        x1 = std::max(x1, right);
+        if (y0 < 0) y0 = y;
+        y1 = y;
+    }
+    if (y0 < 0) return {};
+    return {x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+}
+
+// The region to resize: the content box plus a margin, at least the output
+// size, and widened where needed so the stretch to the encoder's input
+// aspect is no worse than it is for the whole page. The whole page if it is blank or the crop saves little.
+inline Region crop_region(const PageBitmap& page, const PreprocessConfig& config,
+                          const image_preprocess_detail::Kernels& k = image_preprocess_detail::best_kernels()) {
+    const Region full = full_page(page);
+    if (!config.crop) return full;
+    Region box = content_box(page, config.crop_threshold, k);
+    if (box.width == 0) return full;
+
+    const int margin = (int)(config.crop_margin * std::max(page.width, page.height));
+    int x0 = box.x - margin, x1 = box.x + box.width + margin;
+    int y0 = box.y - margin, y1 = box.y + box.height + margin;
+    // Stretch to the output aspect, which the whole page already has to take
+    const double target = (double)config.width / config.height;
+    const double page_aspect = (double)page.width / page.height;
+    const double stretch = std::max(page_aspect / target, target / page_aspect);
+    auto grow = [](int& lo, int& hi, int target_len, int limit) {
+        const int extra = target_len - (hi - lo);
+        if (extra <= 0) return;
+        lo -= extra / 2;
+        hi += extra - extra / 2;
+        if (lo < 0) {
+            hi -= lo;
+            lo = 0;
+        }
+        if (hi > limit) {
+            lo = std::max(0, lo - (hi - limit));
+            hi = limit;
+        }
+    };
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, page.width);
+    y0 = std::max(y0, 0);
+    y1 = std::min(y1, page.height);
+    // Never smaller than the output, so a sparse page isn't blown up
+    grow(x0, x1, std::min(config.width, page.width), page.width);
+    grow(y0, y1, std::min(config.height, page.height), page.height);
+    const double max_tall = stretch / target;     // height / width
+    const double max_wide = stretch * target;     // width / height
+    if ((double)(y1 - y0) / (x1 - x0) > max_tall) grow(x0, x1, (int)std::ceil((y1 - y0) / max_tall), page.width);
+    if ((double)(x1 - x0) / (y1 - y0) > max_wide) grow(y0, y1, (int)std::ceil((x1 - x0) / max_wide), page.height);
+
+    Region crop{x0, y0, x1 - x0, y1 - y0};
+    if ((double)crop.width * crop.height > 0.95 * page.width * page.height) return full;
+    return crop;
+}
+
+// Page -> RGB (or gray, for Gray and Mono pages) at the projector's input size
+inline PixelImage preprocess_page(const PageBitmap& page, const PreprocessConfig& config,
+                                  const image_preprocess_detail::Kernels& k = image_preprocess_detail::best_kernels()) {
+    PixelImage out;
+    out.width = config.width;
+    out.height = config.height;
+    out.channels = page.format == PixelFormat::Bgra ? 3 : 1;
+    const size_t row_len = (size_t)out.width * out.channels;
+    out.data.resize(row_len * out.height);
+    out.source = crop_region(page, config, k);
+    image_preprocess_detail::resample(page, out.source, out.width, out.height, k, [&](int y, const float* row) {
+        k.to_u8(row, &out.data[(size_t)y * row_len], row_len);
+    });
+    return out;
+}
+
+// Page -> planar (CHW) RGB floats, (x / 255 - mean) / std
+inline std::vector<float> preprocess_to_tensor(const PageBitmap& page, const PreprocessConfig& config,
+                                               const image_preprocess_detail::Kernels& k =
+                                                   image_preprocess_detail::best_kernels()) {
+    const size_t plane = (size_t)config.width * config.height;
+    const bool gray = page.format != PixelFormat::Bgra;
+    std::vector<float> out(plane * 3);
+    image_preprocess_detail::resample(page, crop_region(page, config, k), config.width, config.height, k,
+                                      [&](int y, const float* row) {
+        for (int x = 0; x < config.width; ++x) {
+            for (int c = 0; c < 3; ++c) out[c * plane + (size_t)y * config.width + x] = row[gray ? x : x * 3 + c];
+        }
+    });
+    for (int c = 0; c < 3; ++c) {
+        k.scale_bias(&out[c * plane], plane, 1.0f / (255.0f * config.std[c]), -config.mean[c] / config.std[c]);
+    }
+    return out;
+}
+
+// Binary PPM (P6) or PGM (P5): stb_image, which llama-mtmd-cli uses, reads
+// both directly
+inline void write_pnm(const PixelImage& img, const std::string& path) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) throw std::runtime_error("Cannot write image: " + path);
+    fprintf(f, "P%d\n%d %d\n255\n", img.channels == 1 ? 5 : 6, img.width, img.height);
+    size_t written = fwrite(img.data.data(), 1, img.data.size(), f);
+    if (fclose(f) != 0 || written != img.data.size()) throw std::runtime_error("Cannot write image: " + path);
+}
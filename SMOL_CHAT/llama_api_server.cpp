@@ -5,31 +5,280 @@
 #include "llama.h"
 #include "common.h"
 #include "json.hpp"
+#include "detokenizer.h"
+#include "stop_automaton.h"
+#include "http_task_queue.h"
+#include "http_tuning.h"
+#include "request_arena.h"
+#include "request_capture.h"
+#include "request_timing.h"
+#include "shutdown.h"
+#include "tracing.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <cstring>
+#include <map>
 #include <mutex>
 #include <optional>
 #include <iomanip>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <functional>
+#include <cerrno>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using json = nlohmann::json;
 
+// Sampler settings for one generation
+struct SamplingParams {
+    int top_k = 40;
+    float top_p = 0.9f;
+    float temperature = 0.7f;
+    uint32_t seed = 0;
+};
+
+// KV cache layout. Quantized K/V types shrink every sequence's cache, so
+// more concurrent sequences fit in the same memory budget.
+struct KvCacheConfig {
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    int ctx_per_seq = 2048;     // most KV cells a single sequence may reserve
+    size_t budget_bytes = 0;    // total KV budget; 0 means room for one full sequence
+    int max_sequences = 32;     // hard cap on concurrent sequences
+};
+
+ggml_type parse_kv_cache_type(const std::string& name) {
+    if (name == "f16")  return GGML_TYPE_F16;
+    if (name == "bf16") return GGML_TYPE_BF16;
+    if (name == "q8_0") return GGML_TYPE_Q8_0;
+    if (name == "q5_1") return GGML_TYPE_Q5_1;
+    if (name == "q5_0") return GGML_TYPE_Q5_0;
+    if (name == "q4_1") return GGML_TYPE_Q4_1;
+    if (name == "q4_0") return GGML_TYPE_Q4_0;
+    throw std::runtime_error("Unsupported KV cache type: " + name + " (use f16, bf16, q8_0, q5_1, q5_0, q4_1 or q4_0)");
+}
+
+// Read an integer hyperparameter such as "gemma3.attention.key_length".
+static int64_t model_meta_int(const llama_model* model, const std::string& key, int64_t fallback) {
+    char buf[64];
+    if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) <= 0) return fallback;
+    try {
+        return std::stoll(buf);
+    } catch (const std::exception&) {
+        return fallback;
+    }
+}
+
+// Upper bound on KV bytes for one token of one sequence (all layers, K + V).
+// Sliding-window layers may use less than this in practice.
+size_t kv_bytes_per_token(const llama_model* model, ggml_type type_k, ggml_type type_v) {
+    char arch[64] = {0};
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+
+    const int64_t n_layer   = llama_model_n_layer(model);
+    const int64_t n_head    = std::max(1, llama_model_n_head(model));
+    const int64_t n_head_kv = std::max(1, llama_model_n_head_kv(model));
+    const int64_t head_k = model_meta_int(model, std::string(arch) + ".attention.key_length",
+                                          llama_model_n_embd(model) / n_head);
+    const int64_t head_v = model_meta_int(model, std::string(arch) + ".attention.value_length", head_k);
+
+    return n_layer * (ggml_row_size(type_k, head_k * n_head_kv) +
+                      ggml_row_size(type_v, head_v * n_head_kv));
+}
+
+// Hands out sequence ids and KV cells from one shared (unified) cache. Each
+// sequence reserves prompt + max_tokens cells, so a short persona request only
+// holds what it can actually use and many of them pack into the space one
+// long request would take.
+class KvSlotAllocator {
+public:
+    KvSlotAllocator(int total_cells, int max_sequences)
+        : total_cells(total_cells), reserved(max_sequences, 0) {
+        for (int i = max_sequences - 1; i >= 0; --i) free_ids.push_back(i);
+    }
+
+    // Reserve n_cells for a new sequence. Returns nullopt if it doesn't fit
+    // right now; the caller retries once other sequences release cells.
+    std::optional<llama_seq_id> acquire(int n_cells) {
+        if (free_ids.empty() || n_cells > total_cells - reserved_cells) {
+            return std::nullopt;
+        }
+        llama_seq_id seq_id = free_ids.back();
+        free_ids.pop_back();
+        reserved[seq_id] = n_cells;
+        reserved_cells += n_cells;
+        peak_reserved_cells = std::max(peak_reserved_cells, reserved_cells);
+        return seq_id;
+    }
+
+    void release(llama_seq_id seq_id) {
+        reserved_cells -= reserved[seq_id];
+        reserved[seq_id] = 0;
+        free_ids.push_back(seq_id);
+    }
+
+    int capacity() const { return total_cells; }
+    int reservation(llama_seq_id seq_id) const { return reserved[seq_id]; }
+    int free_cells() const { return total_cells - reserved_cells; }
+    int active_sequences() const { return (int)(reserved.size() - free_ids.size()); }
+
+    json metrics() const {
+        return json{
+            {"cells_total", total_cells},
+            {"cells_reserved", reserved_cells},
+            {"cells_free", total_cells - reserved_cells},
+            {"cells_reserved_peak", peak_reserved_cells},
+            {"occupancy", total_cells > 0 ? (double)reserved_cells / total_cells : 0.0},
+            {"sequences_active", active_sequences()},
+            {"sequences_max", (int)reserved.size()}
+        };
+    }
+
+private:
+    int total_cells;
+    int reserved_cells = 0;
+    int peak_reserved_cells = 0;
+    std::vector<int> reserved;            // cells reserved per seq id
+    std::vector<llama_seq_id> free_ids;
+};
+
+// A prompt built from template text and per-request fields. Template parts
+// are tokenized once per model and cached; parts are split where no token
+// would span the boundary (template text ends in ':' or a newline, fields
+// start with a space or follow a newline).
+struct PromptPart {
+    std::string text;
+    bool cached = false;    // fixed template text
+};
+using PromptParts = std::vector<PromptPart>;
+
+// Slot filling: after the prompt, fixed text that the server writes itself
+// alternates with short fields that the model samples under a GBNF grammar.
+// Fixed text is prefilled, never generated token by token; text after the
+// last field isn't decoded at all.
+struct FillStep {
+    std::string text;                   // fixed text
+    std::string grammar;                // non-empty: a sampled field
+    int max_tokens = 8;                 // field length cap
+    std::vector<llama_token> tokens;    // fixed text, tokenized by generate()
+};
+
+struct GenerateOptions {
+    std::vector<std::string> stops;
+    // Sees a sample's output after every token that completes text;
+    // returning true ends that sample. Runs on the scheduler thread.
+    std::function<bool(int sample, std::string_view text)> on_text;
+    std::vector<FillStep> fill;         // non-empty: slot-filling mode
+    // Best-of-N: extra samples are forked from the prefilled prompt and
+    // decoded in the same batch; the highest score wins (ties: lowest
+    // sample). Fewer samples run if the KV budget is short. Not used with
+    // slot filling, whose output is valid by construction.
+    int n_samples = 1;
+    std::function<double(int sample, std::string_view text)> score;
+    int* chosen_sample = nullptr;       // out: the sample returned
+};
+
+// Runs all generations on one llama_context. Requests are queued and a single
+// scheduler thread decodes every active sequence in one batch per step, so
+// concurrent callers share the model instead of taking turns on a mutex.
 class LlamaInference {
 private:
+    struct GenerationRequest {
+        std::vector<llama_token> prompt_tokens;
+        int max_tokens = 0;
+        int n_cells = 0;            // KV cells reserved: prompt + max_tokens
+        bool deferred = false;      // had to wait for cells at least once
+        SamplingParams sampling;
+        std::shared_ptr<const StopAutomaton> stops;  // null = stop on EOS/max_tokens only
+        std::function<bool(int, std::string_view)> on_text;
+        std::vector<FillStep> fill;     // non-empty: slot-filling mode
+        int n_samples = 1;
+        std::function<double(int, std::string_view)> score;
+        std::promise<std::string> result;
+
+        // Best-of-N, set at admission: forked sequences and their outputs
+        std::vector<llama_seq_id> fork_ids;
+        std::vector<std::string> outputs;
+        int samples_running = 0;
+        // Sample 0's sequence once it has finished ahead of the forks: its
+        // reservation covers the prompt cells they still share
+        llama_seq_id held_seq = -1;
+        int chosen_sample = 0;
+
+        // Filled in by the scheduler thread before the result is set
+        std::chrono::steady_clock::time_point enqueued_at;
+        std::chrono::steady_clock::time_point prefill_started_at;
+        std::chrono::steady_clock::time_point decode_started_at;
+        double queue_ms = 0.0;
+        double prefill_ms = 0.0;
+        double decode_ms = 0.0;
+        int n_generated = 0;
+    };
+
+    struct SequenceSlot {
+        llama_seq_id seq_id = 0;
+        std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> sampler{nullptr, llama_sampler_free};
+        std::shared_ptr<GenerationRequest> request;  // null while the slot is idle
+        llama_pos n_past = 0;
+        llama_token next_token = -1;                 // sampled, not yet decoded
+        int sample = 0;                              // best-of-N: which sample this is
+        int n_generated = 0;
+        int32_t batch_index = -1;
+        int cells_used = 0;                          // n_past as of the last step, for metrics
+        Detokenizer detok;                           // buffer kept across requests
+        StopAutomaton::Cursor stop_cursor;
+        size_t fill_step = 0;                        // slot filling: current step
+        int field_tokens = 0;
+        bool fill_pending = false;                   // field done; next step runs after the batch
+        bool next_token_pending = false;             // a capped field's last token isn't decoded yet
+    };
+
+    static inline std::atomic<int> live_instances{0};
+    std::string model_path;
     llama_model* model = nullptr;
     llama_context* ctx = nullptr;
     llama_context_params ctx_params{};
-    std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> sampler_state{nullptr, llama_sampler_free};
-    std::mutex inference_mutex;
+    const llama_vocab* vocab = nullptr;
+    std::unique_ptr<PieceTable> pieces;
+    std::map<std::string, std::shared_ptr<const StopAutomaton>> stop_automata;  // by joined stop list
+    std::mutex stop_mutex;
+    std::map<std::string, std::vector<llama_token>> template_tokens;            // by template text
+    std::mutex template_mutex;
+    KvCacheConfig kv_config;
+    size_t kv_token_bytes = 0;
+    int n_sequences = 1;
+    int n_cells = 0;
+
+    std::vector<SequenceSlot> slots;      // indexed by seq id
+    std::unique_ptr<KvSlotAllocator> allocator;  // guarded by queue_mutex
+    uint64_t deferred_admissions = 0;            // guarded by queue_mutex
+    std::deque<std::shared_ptr<GenerationRequest>> pending;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::atomic<int> n_active{0};
+    bool stopping = false;
+    std::thread scheduler_thread;
 
 public:
-    LlamaInference(const std::string& model_path, int n_ctx = 2048, int n_threads = 4) {
+    LlamaInference(const std::string& model_path, const KvCacheConfig& kv = {}, int n_threads = 4)
+        : model_path(model_path), kv_config(kv) {
         std::cout << "[INIT] Starting llama backend..." << std::endl;
-        llama_backend_init();
+        // Shared by every loaded model (see LanguageModels)
+        if (live_instances++ == 0) llama_backend_init();
 
         std::cout << "[INIT] Loading model from: " << model_path << std::endl;
         llama_model_params mparams = llama_model_default_params();
@@ -37,115 +286,288 @@ public:
         if (!model) throw std::runtime_error("Failed to load model from: " + model_path);
         
         std::cout << "[INIT] Model loaded successfully" << std::endl;
+        vocab = llama_model_get_vocab(model);
+        pieces = std::make_unique<PieceTable>(vocab);
+        std::cout << "[INIT] Piece table: " << pieces->n_tokens() << " tokens, "
+                  << pieces->bytes() / 1024 << " KiB" << std::endl;
+
+        // Size the shared cache from the KV budget; sequences draw cells from
+        // it according to their own length instead of a fixed share each
+        kv_token_bytes = kv_bytes_per_token(model, kv_config.type_k, kv_config.type_v);
+        n_cells = kv_config.ctx_per_seq;
+        if (kv_config.budget_bytes > 0 && kv_token_bytes > 0) {
+            n_cells = (int)std::max<size_t>(kv_config.budget_bytes / kv_token_bytes, 256);
+        }
+        n_sequences = kv_config.max_sequences;
+
+        std::cout << "[INIT] KV cache: type_k=" << ggml_type_name(kv_config.type_k)
+                  << ", type_v=" << ggml_type_name(kv_config.type_v)
+                  << ", " << kv_token_bytes << " bytes/token, "
+                  << std::fixed << std::setprecision(1)
+                  << kv_token_bytes * kv_config.ctx_per_seq / (1024.0 * 1024.0) << " MiB per full-length sequence, "
+                  << kv_token_bytes * (size_t)n_cells / (1024.0 * 1024.0) << " MiB total"
+                  << std::defaultfloat << std::endl;
 
         ctx_params = llama_context_default_params();
-        ctx_params.n_ctx = n_ctx;
+        ctx_params.n_ctx = n_cells;
+        ctx_params.n_seq_max = n_sequences;
+        ctx_params.kv_unified = true;
         ctx_params.n_threads = n_threads;
         ctx_params.n_batch = 512;
+        ctx_params.type_k = kv_config.type_k;
+        ctx_params.type_v = kv_config.type_v;
+        // A quantized V cache is only supported with flash attention
+        if (kv_config.type_v != GGML_TYPE_F16 && kv_config.type_v != GGML_TYPE_BF16) {
+            ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        }
         
-        std::cout << "[INIT] Creating context (n_ctx=" << n_ctx << ", threads=" << n_threads << ")" << std::endl;
+        std::cout << "[INIT] Creating context (n_ctx=" << ctx_params.n_ctx << ", max sequences=" << n_sequences
+                  << ", threads=" << n_threads << ")" << std::endl;
         ctx = llama_init_from_model(model, ctx_params);
         if (!ctx) {
             llama_model_free(model);
             throw std::runtime_error("Failed to create context");
         }
+        n_cells = llama_n_ctx(ctx);
+        allocator = std::make_unique<KvSlotAllocator>(n_cells, n_sequences);
 
-        init_sampler();
+        init_slots();
+        scheduler_thread = std::thread([this] { scheduler_loop(); });
         std::cout << "[INIT] Initialization complete" << std::endl;
     }
 
     ~LlamaInference() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+        if (scheduler_thread.joinable()) scheduler_thread.join();
+
+        slots.clear();
         if (ctx) llama_free(ctx);
         if (model) llama_model_free(model);
-        llama_backend_free();
+        if (--live_instances == 0) llama_backend_free();
     }
 
     LlamaInference(const LlamaInference&) = delete;
     LlamaInference& operator=(const LlamaInference&) = delete;
 
-    std::string generate(const std::string& prompt, int max_tokens = 512) {
-        std::lock_guard<std::mutex> lock(inference_mutex);
-        
+    std::string generate(const std::string& prompt, int max_tokens = 512,
+                         const SamplingParams& sampling = {}, RequestTimings* timings = nullptr,
+                         GenerateOptions options = {}) {
+        return generate(PromptParts{{prompt, false}}, max_tokens, sampling, timings, std::move(options));
+    }
+
+    std::string generate(const PromptParts& prompt, int max_tokens = 512,
+                         const SamplingParams& sampling = {}, RequestTimings* timings = nullptr,
+                         GenerateOptions options = {}) {
+        size_t prompt_chars = 0;
+        for (const auto& part : prompt) prompt_chars += part.text.size();
         std::cout << "\n[GENERATE] Starting generation..." << std::endl;
-        std::cout << "[GENERATE] Prompt length: " << prompt.length() << " chars" << std::endl;
-        std::cout << "[GENERATE] Prompt preview: " << prompt.substr(0, std::min(size_t(200), prompt.length())) << "..." << std::endl;
+        std::cout << "[GENERATE] Prompt length: " << prompt_chars << " chars in " << prompt.size() << " parts" << std::endl;
+        if (!prompt.empty()) {
+            std::cout << "[GENERATE] Prompt preview: " << prompt[0].text.substr(0, 200) << "..." << std::endl;
+        }
         
         if (!model || !ctx) throw std::runtime_error("Model or context not initialized");
 
-        // Clear context and reset sampler
-        std::cout << "[GENERATE] Clearing context..." << std::endl;
-        llama_memory_clear(llama_get_memory(ctx), false);
-        llama_sampler_reset(sampler_state.get());
-        
-        const llama_model* model_info = llama_get_model(ctx);
-        const llama_vocab* vocab = llama_model_get_vocab(model_info);
-
         // Tokenize prompt
         std::cout << "[GENERATE] Tokenizing prompt..." << std::endl;
-        std::vector<llama_token> tokens = tokenize_prompt(vocab, prompt);
-        std::cout << "[GENERATE] Tokenized to " << tokens.size() << " tokens" << std::endl;
+        auto request = std::make_shared<GenerationRequest>();
+        auto t_tokenize = std::chrono::steady_clock::now();
+        request->prompt_tokens = tokenize_parts(prompt);
+        request->max_tokens = max_tokens;
+        request->sampling = sampling;
+        if (!options.stops.empty()) request->stops = stop_automaton(options.stops);
+        request->on_text = std::move(options.on_text);
+        request->score = std::move(options.score);
+        request->n_samples = options.fill.empty() ? std::max(1, options.n_samples) : 1;
+        std::vector<FillStep>& fill = options.fill;
+        if (!fill.empty()) {
+            // Fields can't be adjacent: the next field samples from the
+            // logits of the fixed text before it
+            int fill_tokens = 0;
+            for (size_t i = 0; i < fill.size(); ++i) {
+                if (fill[i].grammar.empty()) {
+                    fill[i].tokens = tokenize_text(fill[i].text);
+                    fill_tokens += fill[i].tokens.size();
+                } else {
+                    if (i == 0 || !fill[i - 1].grammar.empty()) {
+                        throw std::runtime_error("Slot filling: every field must follow fixed text");
+                    }
+                    fill_tokens += fill[i].max_tokens;
+                }
+            }
+            request->fill = std::move(fill);
+            max_tokens = fill_tokens;
+            request->max_tokens = max_tokens;
+        }
+        if (timings) {
+            timings->add("tokenize", RequestTimings::ms_since(t_tokenize),
+                         std::to_string(request->prompt_tokens.size()) + " tokens");
+        }
+        std::cout << "[GENERATE] Tokenized to " << request->prompt_tokens.size() << " tokens" << std::endl;
 
-        // Check if tokens fit in context
-        if (tokens.size() >= ctx_params.n_ctx) {
-            std::cerr << "[ERROR] Prompt too long! " << tokens.size() << " tokens exceeds context size " << ctx_params.n_ctx << std::endl;
+        // Check if tokens fit in what one sequence may reserve
+        const int seq_limit = std::min(kv_config.ctx_per_seq, n_cells);
+        if (request->prompt_tokens.size() >= (size_t)seq_limit) {
+            std::cerr << "[ERROR] Prompt too long! " << request->prompt_tokens.size() << " tokens exceeds context size " << seq_limit << std::endl;
             throw std::runtime_error("Prompt exceeds context size");
         }
+        // Reserve exactly what this request can use, and never generate past
+        // the reservation: those cells belong to other sequences
+        request->n_cells = std::min<int>(request->prompt_tokens.size() + max_tokens, seq_limit);
+        if (!request->fill.empty() && request->n_cells < (int)request->prompt_tokens.size() + max_tokens) {
+            throw std::runtime_error("Prompt and filled text exceed context size");
+        }
+        request->max_tokens = request->n_cells - (int)request->prompt_tokens.size();
 
-        // Decode prompt
-        std::cout << "[GENERATE] Decoding prompt..." << std::endl;
-        decode_prompt(tokens);
-        std::cout << "[GENERATE] Prompt decoded successfully" << std::endl;
+        std::future<std::string> result = request->result.get_future();
+        request->enqueued_at = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (stopping) throw std::runtime_error("Inference engine is shutting down");
+            pending.push_back(request);
+        }
+        queue_cv.notify_one();
 
-        // Make sampler aware of prompt tokens
-        for (auto t : tokens) {
-            llama_sampler_accept(sampler_state.get(), t);
+        std::string text = result.get();
+        if (options.chosen_sample) *options.chosen_sample = request->chosen_sample;
+        if (timings) {
+            timings->add_at("queue", request->enqueued_at, request->queue_ms);
+            timings->add_at("prefill", request->prefill_started_at, request->prefill_ms,
+                            std::to_string(request->prompt_tokens.size()) + " tokens");
+            timings->add_at("decode", request->decode_started_at, request->decode_ms,
+                            std::to_string(request->n_generated) + " tokens" +
+                            (request->outputs.size() > 1 ? " over " + std::to_string(request->outputs.size()) + " samples" : ""));
         }
+        std::cout << "[GENERATE] Generation complete. Generated " << text.length() << " characters" << std::endl;
+        return text;
+    }
 
-        // Generation loop
-        std::cout << "[GENERATE] Starting token generation (max_tokens=" << max_tokens << ")..." << std::endl;
-        std::string result = generate_tokens(vocab, tokens.size(), max_tokens);
-        std::cout << "[GENERATE] Generation complete. Generated " << result.length() << " characters" << std::endl;
-        
-        return result;
+    int max_sequences() const { return n_sequences; }
+
+    const std::string& path() const { return model_path; }
+
+    // Built once per distinct stop list; flagging the vocabulary takes a
+    // pass over the piece table, which is too slow to repeat per request
+    std::shared_ptr<const StopAutomaton> stop_automaton(const std::vector<std::string>& stops) {
+        std::string key;
+        for (const auto& s : stops) key += s + '\0';
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        auto& automaton = stop_automata[key];
+        if (!automaton) automaton = std::make_shared<const StopAutomaton>(stops, *pieces);
+        return automaton;
     }
 
-private:
-    void init_sampler() {
-        std::cout << "[INIT] Initializing sampler chain..." << std::endl;
-        llama_sampler_chain_params schain_params = llama_sampler_chain_default_params();
-        sampler_state.reset(llama_sampler_chain_init(schain_params));
-        if (!sampler_state) {
-            llama_free(ctx);
-            llama_model_free(model);
-            throw std::runtime_error("Failed to initialize sampler chain");
+    json metrics() {
+        size_t queued;
+        json slot_metrics;
+        json sequences = json::array();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queued = pending.size();
+            slot_metrics = allocator->metrics();
+            slot_metrics["admissions_deferred"] = deferred_admissions;
+            for (const auto& slot : slots) {
+                const int cells_reserved = allocator->reservation(slot.seq_id);
+                if (cells_reserved == 0) continue;
+                sequences.push_back({
+                    {"seq_id", slot.seq_id},
+                    {"cells_reserved", cells_reserved},
+                    {"cells_used", slot.cells_used},
+                    {"bytes_reserved", kv_token_bytes * cells_reserved}
+                });
+            }
         }
+        slot_metrics["sequences"] = std::move(sequences);
+        return json{
+            {"kv_cache", {
+                {"type_k", ggml_type_name(kv_config.type_k)},
+                {"type_v", ggml_type_name(kv_config.type_v)},
+                {"bytes_per_token", kv_token_bytes},
+                {"max_ctx_per_sequence", kv_config.ctx_per_seq},
+                {"bytes_total", kv_token_bytes * (size_t)n_cells},
+                {"budget_bytes", kv_config.budget_bytes}
+            }},
+            {"kv_slots", slot_metrics},
+            {"scheduler", {
+                {"max_sequences", n_sequences},
+                {"active_sequences", n_active.load()},
+                {"queued_requests", queued}
+            }}
+        };
+    }
 
-        llama_sampler_chain_add(sampler_state.get(), llama_sampler_init_top_k(40));
-        llama_sampler_chain_add(sampler_state.get(), llama_sampler_init_top_p(0.9f, 1));
-        llama_sampler_chain_add(sampler_state.get(), llama_sampler_init_temp(0.7f));
-        llama_sampler_chain_add(sampler_state.get(), llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-        std::cout << "[INIT] Sampler chain configured (top_k=40, top_p=0.9, temp=0.7)" << std::endl;
+private:
+    void init_slots() {
+        std::cout << "[INIT] Initializing " << n_sequences << " sequence slot(s)..." << std::endl;
+        slots.resize(n_sequences);
+        for (int i = 0; i < n_sequences; ++i) {
+            slots[i].seq_id = i;
+        }
     }
 
-    std::vector<llama_token> tokenize_prompt(const llama_vocab* vocab, const std::string& prompt) {
-        std::vector<llama_token> tokens;
-        tokens.resize(prompt.size() * 4 + 16);
+    // Each request gets a fresh chain so its seed and settings are its own
+    llama_sampler* make_sampler(const SamplingParams& params, const std::string& grammar = "") {
+        llama_sampler_chain_params schain_params = llama_sampler_chain_default_params();
+        llama_sampler* chain = llama_sampler_chain_init(schain_params);
+        if (!chain) return nullptr;
 
-        int n_tokens = llama_tokenize(vocab,
-                                     prompt.c_str(), (int)prompt.size(),
-                                     tokens.data(), (int)tokens.size(),
-                                     true,  // add_special
-                                     false); // parse_special
-        
+        if (!grammar.empty()) {
+            llama_sampler* constraint = llama_sampler_init_grammar(vocab, grammar.c_str(), "root");
+            if (!constraint) {
+                llama_sampler_free(chain);
+                return nullptr;
+            }
+            llama_sampler_chain_add(chain, constraint);
+        }
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temperature));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+        return chain;
+    }
+
+    std::vector<llama_token> tokenize_text(const std::string& text) const {
+        std::vector<llama_token> tokens(text.size() + 16);
+        int n_tokens = llama_tokenize(vocab, text.c_str(), (int)text.size(), tokens.data(), (int)tokens.size(),
+                                      false,  // add_special: BOS is added once for the whole prompt
+                                      false); // parse_special
+        if (n_tokens < 0) {
+            // Buffer too small; -n_tokens is the size needed
+            tokens.resize(-n_tokens);
+            n_tokens = llama_tokenize(vocab, text.c_str(), (int)text.size(), tokens.data(), (int)tokens.size(),
+                                      false, false);
+        }
         if (n_tokens < 0) {
             std::cerr << "[ERROR] Tokenization failed with code: " << n_tokens << std::endl;
             throw std::runtime_error("Tokenization failed");
         }
-        
         tokens.resize(n_tokens);
-        
+        return tokens;
+    }
+
+    std::vector<llama_token> tokenize_parts(const PromptParts& parts) {
+        std::vector<llama_token> tokens;
+        if (llama_vocab_get_add_bos(vocab)) tokens.push_back(llama_vocab_bos(vocab));
+        size_t n_cached = 0;
+        for (const auto& part : parts) {
+            if (!part.cached) {
+                std::vector<llama_token> t = tokenize_text(part.text);
+                tokens.insert(tokens.end(), t.begin(), t.end());
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(template_mutex);
+            auto it = template_tokens.find(part.text);
+            if (it == template_tokens.end()) it = template_tokens.emplace(part.text, tokenize_text(part.text)).first;
+            tokens.insert(tokens.end(), it->second.begin(), it->second.end());
+            n_cached += it->second.size();
+        }
+
         // Debug: print first few tokens
-        std::cout << "[TOKENIZE] First few tokens: ";
+        std::cout << "[TOKENIZE] " << n_cached << " of " << tokens.size() << " tokens from cached templates. First few: ";
         for (size_t i = 0; i < std::min(size_t(10), tokens.size()); ++i) {
             std::cout << tokens[i] << " ";
         }
@@ -154,176 +576,632 @@ private:
         return tokens;
     }
 
-    void decode_prompt(const std::vector<llama_token>& tokens) {
-        llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
-        batch.n_tokens = tokens.size();
-        
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            batch.token[i]   = tokens[i];
-            batch.pos[i]     = i;
-            batch.logits[i]  = (i == tokens.size() - 1);  // Only last token needs logits
-            batch.n_seq_id[i] = 1;
-            batch.seq_id[i][0] = 0;
+    void scheduler_loop() {
+        for (;;) {
+            std::vector<SequenceSlot*> admitted;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this] { return stopping || !pending.empty() || n_active > 0; });
+                if (stopping) break;
+
+                // Admit in arrival order while the head request's reservation
+                // fits; later small requests don't jump a waiting large one
+                while (!pending.empty()) {
+                    auto seq_id = allocator->acquire(pending.front()->n_cells);
+                    if (!seq_id) {
+                        if (!pending.front()->deferred) {
+                            pending.front()->deferred = true;
+                            ++deferred_admissions;
+                        }
+                        break;
+                    }
+                    SequenceSlot& slot = slots[*seq_id];
+                    slot.request = std::move(pending.front());
+                    pending.pop_front();
+                    slot.request->queue_ms = RequestTimings::ms_since(slot.request->enqueued_at);
+                    slot.sample = 0;
+                    admitted.push_back(&slot);
+                    ++n_active;
+
+                    // Forks share the prompt's cells, which stay reserved
+                    // under sample 0 until the last sample ends, and only
+                    // need room for their own output (max_tokens, already
+                    // capped to the primary's reservation); take as many as
+                    // fit right now
+                    auto& request = *slot.request;
+                    for (int k = 1; k < request.n_samples; ++k) {
+                        auto fork_id = allocator->acquire(request.max_tokens);
+                        if (!fork_id) break;
+                        SequenceSlot& fork = slots[*fork_id];
+                        fork.request = slot.request;
+                        fork.sample = k;
+                        request.fork_ids.push_back(*fork_id);
+                        ++n_active;
+                    }
+                    request.samples_running = 1 + (int)request.fork_ids.size();
+                    request.outputs.assign(request.samples_running, std::string());
+                }
+            }
+
+            for (SequenceSlot* slot : admitted) {
+                start_sequence(*slot);
+            }
+            if (n_active > 0) {
+                decode_step();
+            }
+
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            for (auto& slot : slots) {
+                if (slot.request) slot.cells_used = slot.n_past;
+            }
+        }
+
+        // Fail everything still waiting so callers don't block forever
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        auto shutdown_error = std::make_exception_ptr(std::runtime_error("Inference engine is shutting down"));
+        for (auto& request : pending) request->result.set_exception(shutdown_error);
+        pending.clear();
+        for (auto& slot : slots) {
+            // Best-of-N samples share one request; fail it once
+            if (slot.request && slot.request->samples_running > 0) {
+                slot.request->samples_running = 0;
+                slot.request->result.set_exception(shutdown_error);
+            }
+            slot.request.reset();
+        }
+    }
+
+    // Prefill the prompt for a newly admitted sequence and sample its first token.
+    void start_sequence(SequenceSlot& slot) {
+        const auto& tokens = slot.request->prompt_tokens;
+        std::cout << "[GENERATE] seq " << slot.seq_id << ": decoding prompt (" << tokens.size() << " tokens, "
+                  << slot.request->n_cells << " cells reserved)..." << std::endl;
+
+        // Slot filling makes a constrained sampler per field instead
+        slot.sampler.reset(slot.request->fill.empty() ? make_sampler(slot.request->sampling) : nullptr);
+        if (!slot.sampler && slot.request->fill.empty()) {
+            fail_sequence(slot, std::runtime_error("Failed to initialize sampler chain"));
+            return;
+        }
+        // Pieces average a few bytes; reserving for 8 per token avoids
+        // regrowing the buffer mid-generation in all but unusual outputs
+        slot.detok.reset((size_t)slot.request->max_tokens * 8);
+        slot.stop_cursor = {};
+        slot.n_generated = 0;
+        slot.n_past = 0;
+
+        auto t_prefill = std::chrono::steady_clock::now();
+        slot.request->prefill_started_at = t_prefill;
+        int32_t last_index = -1;
+        if (!decode_tokens(slot, tokens, last_index)) {
+            fail_sequence(slot, std::runtime_error("Failed to decode prompt"));
+            return;
+        }
+
+        if (!slot.request->fill.empty()) {
+            slot.request->prefill_ms = RequestTimings::ms_since(t_prefill);
+            slot.request->decode_started_at = std::chrono::steady_clock::now();
+            slot.fill_step = 0;
+            slot.next_token_pending = false;
+            run_fill_step(slot, last_index);
+            return;
+        }
+
+        // Make sampler aware of prompt tokens
+        for (auto t : tokens) {
+            llama_sampler_accept(slot.sampler.get(), t);
+        }
+
+        // Best-of-N: the forks reference the prompt's KV cells instead of
+        // prefilling again, and each samples with its own seed
+        auto request = slot.request;
+        std::vector<SequenceSlot*> samples = {&slot};
+        for (llama_seq_id fork_id : request->fork_ids) {
+            SequenceSlot& fork = slots[fork_id];
+            llama_memory_seq_cp(llama_get_memory(ctx), slot.seq_id, fork.seq_id, -1, -1);
+            SamplingParams params = request->sampling;
+            params.seed += fork.sample;
+            fork.sampler.reset(make_sampler(params));
+            if (!fork.sampler) {
+                fail_sequence(slot, std::runtime_error("Failed to initialize sampler chain"));
+                return;
+            }
+            for (auto t : tokens) llama_sampler_accept(fork.sampler.get(), t);
+            fork.detok.reset((size_t)request->max_tokens * 8);
+            fork.stop_cursor = {};
+            fork.n_generated = 0;
+            fork.n_past = slot.n_past;
+            samples.push_back(&fork);
+        }
+        request->prefill_ms = RequestTimings::ms_since(t_prefill);
+        request->decode_started_at = std::chrono::steady_clock::now();
+
+        std::cout << "[GENERATE] seq " << slot.seq_id << ": starting token generation (max_tokens=" << request->max_tokens
+                  << (samples.size() > 1 ? ", samples=" + std::to_string(samples.size()) : "") << ")..." << std::endl;
+        // All samples read the same logits row; sampling doesn't modify it
+        for (SequenceSlot* sample : samples) {
+            if (sample->request) handle_sampled(*sample, llama_sampler_sample(sample->sampler.get(), ctx, last_index));
+        }
+    }
+
+    // Decodes tokens for one sequence from its current position, in n_batch
+    // chunks; last_index is the logits row of the final token
+    bool decode_tokens(SequenceSlot& slot, const std::vector<llama_token>& tokens, int32_t& last_index) {
+        const size_t n_batch = ctx_params.n_batch;
+        llama_batch batch = llama_batch_init(n_batch, 0, 1);
+        for (size_t start = 0; start < tokens.size(); start += n_batch) {
+            const size_t n = std::min(n_batch, tokens.size() - start);
+            batch.n_tokens = n;
+            for (size_t i = 0; i < n; ++i) {
+                batch.token[i]    = tokens[start + i];
+                batch.pos[i]      = slot.n_past + start + i;
+                batch.logits[i]   = (start + i == tokens.size() - 1);  // Only last token needs logits
+                batch.n_seq_id[i] = 1;
+                batch.seq_id[i][0] = slot.seq_id;
+            }
+
+            int decode_result = llama_decode(ctx, batch);
+            if (decode_result != 0) {
+                llama_batch_free(batch);
+                std::cerr << "[ERROR] Decode failed with code: " << decode_result << std::endl;
+                return false;
+            }
+            last_index = n - 1;
         }
-        
-        int decode_result = llama_decode(ctx, batch);
         llama_batch_free(batch);
-        
-        if (decode_result != 0) {
-            std::cerr << "[ERROR] Decode failed with code: " << decode_result << std::endl;
-            throw std::runtime_error("Failed to decode prompt");
+        slot.n_past += tokens.size();
+        return true;
+    }
+
+    // Slot filling: writes and prefills the fixed text at the current step,
+    // then starts sampling the field after it. last_index is the logits row
+    // to sample from when the step is a field.
+    void run_fill_step(SequenceSlot& slot, int32_t last_index) {
+        const auto& fill = slot.request->fill;
+        if (slot.fill_step < fill.size() && fill[slot.fill_step].grammar.empty()) {
+            const FillStep& step = fill[slot.fill_step++];
+            slot.detok.append(step.text);
+            if (slot.fill_step == fill.size()) {
+                finish_sequence(slot);
+                return;
+            }
+            std::vector<llama_token> tokens;
+            if (slot.next_token_pending) tokens.push_back(slot.next_token);
+            tokens.insert(tokens.end(), step.tokens.begin(), step.tokens.end());
+            slot.next_token_pending = false;
+            if (!decode_tokens(slot, tokens, last_index)) {
+                fail_sequence(slot, std::runtime_error("Failed to decode fixed text"));
+                return;
+            }
+        }
+        if (slot.fill_step == fill.size()) {
+            finish_sequence(slot);
+            return;
         }
+        slot.sampler.reset(make_sampler(slot.request->sampling, fill[slot.fill_step].grammar));
+        if (!slot.sampler) {
+            fail_sequence(slot, std::runtime_error("Invalid field grammar"));
+            return;
+        }
+        slot.field_tokens = 0;
+        handle_sampled(slot, llama_sampler_sample(slot.sampler.get(), ctx, last_index));
     }
 
-    std::string generate_tokens(const llama_vocab* vocab, size_t prompt_length, int max_tokens) {
-        std::string response;
-        int n_generated = 0;
-        int64_t cur_pos = prompt_length;
-        int eos_count = 0;
+    void end_field(SequenceSlot& slot) {
+        ++slot.fill_step;
+        slot.fill_pending = true;
+    }
 
-        while (n_generated < max_tokens) {
-            llama_token new_token = llama_sampler_sample(sampler_state.get(), ctx, -1);
-            
-            // Debug logging every 10 tokens
-            if (n_generated % 10 == 0 || n_generated < 5) {
-                std::cout << "[GEN] Token " << n_generated << ": " << new_token << std::endl;
+    // Decode the pending token of every active sequence in one batch and
+    // sample each sequence's next token from its own logits row.
+    void decode_step() {
+        llama_batch batch = llama_batch_init(n_sequences, 0, 1);
+        batch.n_tokens = 0;
+        for (auto& slot : slots) {
+            if (!slot.request || slot.fill_pending) continue;
+            const int32_t i = batch.n_tokens++;
+            batch.token[i]    = slot.next_token;
+            batch.pos[i]      = slot.n_past;
+            batch.logits[i]   = 1;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = slot.seq_id;
+            slot.batch_index = i;
+        }
+
+        int decode_result = batch.n_tokens > 0 ? llama_decode(ctx, batch) : 0;
+        llama_batch_free(batch);
+
+        for (auto& slot : slots) {
+            if (!slot.request || slot.fill_pending) continue;
+            if (decode_result != 0) {
+                // Partial output would look like a complete one to the caller
+                std::cerr << "[ERROR] Decode failed at token " << slot.n_generated << " with code " << decode_result << std::endl;
+                fail_sequence(slot, std::runtime_error("Failed to decode token " + std::to_string(slot.n_generated)));
+                continue;
             }
+            ++slot.n_past;
+            handle_sampled(slot, llama_sampler_sample(slot.sampler.get(), ctx, slot.batch_index));
+        }
 
-            // Check for EOS
-            if (new_token == llama_vocab_eos(vocab)) {
-                eos_count++;
-                std::cout << "[GEN] EOS token encountered at position " << n_generated << std::endl;
-                if (eos_count >= 1) {  // Stop on first EOS
-                    break;
-                }
+        // Fixed text after a finished field, outside the batch loop above:
+        // its decode would replace the logits the other sequences sample from
+        for (auto& slot : slots) {
+            if (!slot.request || !slot.fill_pending) continue;
+            slot.fill_pending = false;
+            run_fill_step(slot, -1);
+        }
+    }
+
+    void handle_sampled(SequenceSlot& slot, llama_token new_token) {
+        // Debug logging every 10 tokens
+        if (slot.n_generated % 10 == 0 || slot.n_generated < 5) {
+            std::cout << "[GEN] seq " << slot.seq_id << " token " << slot.n_generated << ": " << new_token << std::endl;
+        }
+
+        // A field ends when its grammar is complete and only end-of-generation
+        // tokens remain
+        const bool filling = !slot.request->fill.empty();
+        if (filling && llama_vocab_is_eog(vocab, new_token)) {
+            end_field(slot);
+            return;
+        }
+
+        // Check for EOS
+        if (new_token == llama_vocab_eos(vocab)) {
+            std::cout << "[GEN] seq " << slot.seq_id << ": EOS token encountered at position " << slot.n_generated << std::endl;
+            finish_sequence(slot);
+            return;
+        }
+
+        // Check for invalid tokens
+        if (new_token < 0) {
+            std::cerr << "[ERROR] Invalid token sampled: " << new_token << std::endl;
+            finish_sequence(slot);
+            return;
+        }
+
+        // Convert token to text; a partial UTF-8 character yields no text yet
+        std::string_view text = slot.detok.push(*pieces, new_token);
+        if (slot.n_generated < 20) {
+            std::cout << "[GEN] seq " << slot.seq_id << " piece " << slot.n_generated << ": \"" << text << "\"" << std::endl;
+        }
+
+        llama_sampler_accept(slot.sampler.get(), new_token);
+        slot.next_token = new_token;
+        ++slot.n_generated;
+
+        if (filling) {
+            if (++slot.field_tokens >= slot.request->fill[slot.fill_step].max_tokens) {
+                slot.next_token_pending = true;
+                end_field(slot);
             }
+            return;
+        }
 
-            // Check for invalid tokens
-            if (new_token < 0) {
-                std::cerr << "[ERROR] Invalid token sampled: " << new_token << std::endl;
-                break;
+        if (!text.empty() && slot.request->on_text && slot.request->on_text(slot.sample, slot.detok.text())) {
+            std::cout << "[GEN] seq " << slot.seq_id << ": output complete at token " << slot.n_generated << std::endl;
+            finish_sequence(slot);
+            return;
+        }
+        if (slot.request->stops) {
+            const size_t cut = slot.request->stops->advance(slot.stop_cursor, new_token, text, slot.detok.verbatim());
+            if (cut != SIZE_MAX) {
+                std::cout << "[GEN] seq " << slot.seq_id << ": stop string matched at token " << slot.n_generated << std::endl;
+                slot.detok.truncate(cut);
+                finish_sequence(slot);
+                return;
             }
+        }
 
-            // Convert token to text
-            char buf[256];
-            int n = llama_token_to_piece(vocab, new_token, buf, (int)sizeof(buf), 0, false);
-            if (n > 0) {
-                std::string piece(buf, n);
-                response.append(piece);
-                
-                // Debug: print first few pieces
-                if (n_generated < 20) {
-                    std::cout << "[GEN] Piece " << n_generated << ": \"" << piece << "\"" << std::endl;
+        if (slot.n_generated >= slot.request->max_tokens) {
+            finish_sequence(slot);
+        }
+    }
+
+    void finish_sequence(SequenceSlot& slot) {
+        std::cout << "[GEN] seq " << slot.seq_id << ": generation loop completed. Tokens generated: " << slot.n_generated << std::endl;
+        std::cout << "[GEN] seq " << slot.seq_id << ": response length: " << slot.detok.text().size() << " characters" << std::endl;
+        if (slot.detok.pending() > 0) {
+            std::cerr << "[WARN] seq " << slot.seq_id << ": dropping " << slot.detok.pending()
+                      << " bytes of an incomplete UTF-8 character" << std::endl;
+        }
+        // Release first so the caller observes the freed cells when it wakes
+        auto request = slot.request;
+        request->n_generated += slot.n_generated;
+        request->outputs[slot.sample] = std::string(slot.detok.text());
+        const bool hold = slot.sample == 0 && request->samples_running > 1;
+        if (hold) request->held_seq = slot.seq_id;
+        release_slot(slot, hold);
+        if (--request->samples_running > 0) return;     // other samples still decoding
+        release_held(*request);
+
+        request->decode_ms = RequestTimings::ms_since(request->decode_started_at);
+        request->chosen_sample = 0;
+        if (request->outputs.size() > 1 && request->score) {
+            double best = 0.0;
+            for (size_t k = 0; k < request->outputs.size(); ++k) {
+                const double score = request->score((int)k, request->outputs[k]);
+                std::cout << "[GEN] sample " << k << " score " << score << std::endl;
+                if (k == 0 || score > best) {
+                    best = score;
+                    request->chosen_sample = (int)k;
                 }
-            } else {
-                std::cerr << "[WARN] token_to_piece returned " << n << " for token " << new_token << std::endl;
             }
+        }
+        request->result.set_value(std::move(request->outputs[request->chosen_sample]));
+    }
 
-            llama_sampler_accept(sampler_state.get(), new_token);
+    // Fails the request, releasing every sample slot it holds
+    void fail_sequence(SequenceSlot& slot, const std::exception& error) {
+        auto request = slot.request;
+        for (auto& other : slots) {
+            if (other.request == request) release_slot(other);
+        }
+        release_held(*request);
+        request->samples_running = 0;
+        request->result.set_exception(std::make_exception_ptr(std::runtime_error(error.what())));
+    }
 
-            // Decode next token
-            llama_batch next_batch = llama_batch_init(1, 0, 1);
-            next_batch.n_tokens = 1;
-            next_batch.token[0] = new_token;
-            next_batch.pos[0] = (llama_pos)cur_pos;
-            next_batch.logits[0] = 1;
-            next_batch.n_seq_id[0] = 1;
-            next_batch.seq_id[0][0] = 0;
+    // Drop the sequence's cells right away so they are reusable by the next
+    // admission. The unified cache places cells non-contiguously, so freed
+    // cells never need compacting before reuse. With keep_reservation the
+    // slot goes idle but its cells stay accounted for: cells that forks
+    // still reference are not freed by seq_rm.
+    void release_slot(SequenceSlot& slot, bool keep_reservation = false) {
+        llama_memory_seq_rm(llama_get_memory(ctx), slot.seq_id, -1, -1);
+        slot.n_past = 0;
+        slot.fill_pending = false;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            slot.request.reset();
+            slot.cells_used = 0;
+            if (!keep_reservation) allocator->release(slot.seq_id);
+        }
+        --n_active;
+    }
 
-            int decode_result = llama_decode(ctx, next_batch);
-            llama_batch_free(next_batch);
-            
-            if (decode_result != 0) {
-                std::cerr << "[ERROR] Decode failed at token " << n_generated << " with code " << decode_result << std::endl;
-                break;
+    // Returns the reservation sample 0 kept for its forks
+    void release_held(GenerationRequest& request) {
+        if (request.held_seq < 0) return;
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        allocator->release(request.held_seq);
+        request.held_seq = -1;
+    }
+};
+
+std::string language_code(const std::string& language);
+
+// Routes persona requests to a model by language. Languages whose text a
+// model's tokenizer encodes poorly take several times the tokens, so a
+// language group can be served by a model with a better vocabulary for it
+// (--language-model ja,zh,ko=PATH); everything else uses the default model.
+// Each model has its own context and KV budget.
+class LanguageModels {
+public:
+    LanguageModels(const std::string& default_path,
+                   const std::vector<std::pair<std::string, std::string>>& routes,
+                   const KvCacheConfig& kv, int n_threads) {
+        default_model = &load(default_path, kv, n_threads);
+        for (const auto& [languages, path] : routes) {
+            LlamaInference& model = load(path, kv, n_threads);
+            std::stringstream ss(languages);
+            for (std::string lang; std::getline(ss, lang, ',');) {
+                if (lang.empty()) continue;
+                by_language[language_code(lang)] = &model;
+                std::cout << "[INIT] Language " << language_code(lang) << " -> " << path << std::endl;
             }
+        }
+    }
+
+    LlamaInference& for_language(const std::string& code) {
+        auto it = by_language.find(code);
+        return it != by_language.end() ? *it->second : *default_model;
+    }
+
+    int max_sequences() const {
+        int n = 0;
+        for (const auto& [path, model] : by_path) n += model->max_sequences();
+        return n;
+    }
 
-            ++cur_pos;
-            ++n_generated;
+    // The default model's metrics at the top level, as before, plus one
+    // entry per language model
+    json metrics() {
+        json out = default_model->metrics();
+        for (const auto& [path, model] : by_path) {
+            if (model.get() == default_model) continue;
+            json languages = json::array();
+            for (const auto& [lang, m] : by_language) {
+                if (m == model.get()) languages.push_back(lang);
+            }
+            json entry = model->metrics();
+            entry["languages"] = languages;
+            out["language_models"][path] = entry;
         }
+        return out;
+    }
 
-        std::cout << "[GEN] Generation loop completed. Tokens generated: " << n_generated << std::endl;
-        std::cout << "[GEN] Response length: " << response.length() << " characters" << std::endl;
-        
-        return response;
+private:
+    LlamaInference& load(const std::string& path, const KvCacheConfig& kv, int n_threads) {
+        auto& model = by_path[path];
+        if (!model) model = std::make_unique<LlamaInference>(path, kv, n_threads);
+        return *model;
     }
+
+    std::map<std::string, std::unique_ptr<LlamaInference>> by_path;
+    std::map<std::string, LlamaInference*> by_language;
+    LlamaInference* default_model = nullptr;
 };
 
-std::string create_persona_prompt(const json& input_json) {
+// Maps "German", "Deutsch", "de", "de-AT" and so on to a language code.
+// Unknown languages come back lower-cased as given.
+std::string language_code(const std::string& language) {
+    std::string lang;
+    for (char c : language) {
+        if (c == '-' || c == '_') break;
+        if (!std::isspace((unsigned char)c)) lang += (char)std::tolower((unsigned char)c);
+    }
+    static const std::map<std::string, std::string> kNames = {
+        {"english", "en"}, {"german", "de"}, {"deutsch", "de"}, {"french", "fr"}, {"français", "fr"},
+        {"francais", "fr"}, {"spanish", "es"}, {"español", "es"}, {"espanol", "es"}, {"italian", "it"},
+        {"italiano", "it"}, {"portuguese", "pt"}, {"português", "pt"}, {"portugues", "pt"},
+        {"dutch", "nl"}, {"nederlands", "nl"}, {"russian", "ru"}, {"japanese", "ja"}, {"chinese", "zh"},
+        {"mandarin", "zh"}, {"korean", "ko"}, {"arabic", "ar"}, {"turkish", "tr"}, {"polish", "pl"},
+    };
+    auto it = kNames.find(lang);
+    return it != kNames.end() ? it->second : lang;
+}
+
+// The instruction line per language; the labels and the output format stay
+// English so that extraction and the draft-reply prompt can rely on them
+const std::string& persona_instruction(const std::string& code) {
+    static const std::map<std::string, std::string> kInstructions = {
+        {"en", "Generate a one-sentence professional persona summary."},
+        {"de", "Erstelle eine professionelle Persona-Zusammenfassung in einem Satz, genau im Ausgabeformat unten."},
+        {"fr", "Rédige un résumé de persona professionnel en une phrase, exactement au format de sortie ci-dessous."},
+        {"es", "Genera un resumen profesional de la persona en una frase, exactamente en el formato de salida indicado."},
+        {"it", "Genera un riassunto professionale della persona in una frase, esattamente nel formato di output indicato."},
+        {"pt", "Gere um resumo profissional da persona em uma frase, exatamente no formato de saída abaixo."},
+        {"nl", "Schrijf een professionele persona-samenvatting van één zin, precies in het uitvoerformaat hieronder."},
+    };
+    auto it = kInstructions.find(code);
+    return it != kInstructions.end() ? it->second : kInstructions.at("en");
+}
+
+// Template text is marked cached: it is the same for every request in a
+// language, so each model tokenizes it once. The samples are joined in
+// request scratch memory.
+PromptParts create_persona_prompt(const json& input_json, std::pmr::memory_resource* scratch) {
     std::string name = input_json["name"];
     std::string position = input_json["position"];
     std::string department = input_json["department"];
     std::string language = input_json["language"];
     
-    std::string samples_text;
+    std::pmr::string samples_text(scratch);
     if (input_json.contains("samples") && input_json["samples"].is_array()) {
         for (const auto& sample : input_json["samples"]) {
-            samples_text += sample.get<std::string>() + " ";
+            samples_text += sample.get_ref<const std::string&>();
+            samples_text += ' ';
         }
     }
     
     // Simplified prompt for better results with smaller models
-    std::string prompt =
-    "Generate a one-sentence professional persona summary.\n\n"
-    "Input:\n"
-    "Name: " + name + "\n"
-    "Position: " + position + "\n"
-    "Department: " + department + "\n"
-    "Language: " + language + "\n"
-    "Writing samples: " + samples_text + "\n\n"
-    "Output format:it should include these fild specifically\n"
-    + name + " (" + position + ", " + department + "). Preferred language: " + language + ". [tone] tone. [style] communication style.\n\n"
-    "Persona:";
-    
-    return prompt;
+    return {
+        {persona_instruction(language_code(language)) + "\n\nInput:\nName:", true},
+        {" " + name + "\n", false},
+        {"Position:", true},
+        {" " + position + "\n", false},
+        {"Department:", true},
+        {" " + department + "\n", false},
+        {"Language:", true},
+        {" " + language + "\n", false},
+        {"Writing samples:", true},
+        {std::string(" ").append(samples_text).append("\n\n"), false},
+        {"Output format:it should include these fild specifically\n", true},
+        {name + " (" + position + ", " + department + "). Preferred language: " + language + ".", false},
+        {" [tone] tone. [style] communication style.\n\nPersona:", true},
+    };
 }
 
-std::string extract_persona_line(const std::string& raw_output, const std::string& name) {
-    if (raw_output.empty()) {
-        std::cout << "[EXTRACT] Empty raw output" << std::endl;
-        return "";
-    }
-    
-    std::cout << "[EXTRACT] Processing output of length " << raw_output.length() << std::endl;
-    
-    std::istringstream stream(raw_output);
-    std::string line;
-    std::string best_line;
-    int line_count = 0;
-    
-    while (std::getline(stream, line)) {
-        line_count++;
-        
-        // Trim the line
-        line.erase(0, line.find_first_not_of(" \n\r\t\""));
-        line.erase(line.find_last_not_of(" \n\r\t\"") + 1);
-        
-        std::cout << "[EXTRACT] Line " << line_count << " (len=" << line.length() << "): \"" << line.substr(0, 80) << "...\"" << std::endl;
-        
-        // Skip empty lines, code blocks, or metadata
-        if (line.empty() || line == "```" || line.find("Persona:") != std::string::npos) {
-            continue;
+// Slot-filling version of the persona line: everything but the tone and
+// the communication style is known, so the server writes it and the model
+// only picks those two words from fixed lists
+std::vector<FillStep> persona_fill_steps(const json& input_json) {
+    static const std::string kToneGrammar =
+        "root ::= \" \" (\"Formal\" | \"Professional\" | \"Friendly\" | \"Warm\" | \"Casual\" | "
+        "\"Confident\" | \"Diplomatic\" | \"Enthusiastic\" | \"Neutral\" | \"Empathetic\")";
+    static const std::string kStyleGrammar =
+        "root ::= \" \" (\"Direct\" | \"Concise\" | \"Detailed\" | \"Collaborative\" | \"Analytical\" | "
+        "\"Structured\" | \"Conversational\" | \"Persuasive\" | \"Supportive\" | \"Technical\")";
+    std::string name = input_json["name"];
+    std::string position = input_json["position"];
+    std::string department = input_json["department"];
+    std::string language = input_json["language"];
+    return {
+        {" " + name + " (" + position + ", " + department + "). Preferred language: " + language + ".", "", 0, {}},
+        {"", kToneGrammar, 8, {}},
+        {" tone.", "", 0, {}},
+        {"", kStyleGrammar, 8, {}},
+        {" communication style.", "", 0, {}},
+    };
+}
+
+// Finds the persona line while it is being generated. Fed the whole output
+// after every token; it only looks at the bytes added since the last call
+// and keeps offsets into the output rather than copies of lines. A line
+// that starts with the user's name and is long enough is the persona, and
+// generation can stop as soon as it is complete: at its newline, or at the
+// "communication style." that ends the requested format. Otherwise the last
+// line that looks like "... (position, department) ..." is kept as the best
+// guess.
+class PersonaExtractor {
+public:
+    explicit PersonaExtractor(std::string name) : name(std::move(name)) {}
+
+    // Returns true once the persona line is complete
+    bool feed(std::string_view text) {
+        if (done) return true;
+        for (; scanned < text.size(); ++scanned) {
+            if (text[scanned] == '\n') {
+                check_line(text, line_start, scanned);
+                line_start = scanned + 1;
+                if (done) return true;
+            }
         }
-        
-        // Look for a line that starts with the user's name
-        if (line.find(name) == 0 && line.length() > 50) {
-            best_line = line;
-            std::cout << "[EXTRACT] Found matching line starting with name" << std::endl;
-            break;
+        // The requested format ends with "communication style."
+        static constexpr std::string_view kEnd = "style.";
+        size_t e = text.find_last_not_of(kTrim);
+        if (e != std::string_view::npos && e + 1 >= line_start + kEnd.size() &&
+            text.compare(e + 1 - kEnd.size(), kEnd.size(), kEnd) == 0) {
+            check_line(text, line_start, text.size());
         }
-        
-        // Accept lines that look like persona descriptions
-        if (line.length() > 50 && line.find("(") != std::string::npos && 
-            line.find(")") != std::string::npos) {
-            best_line = line;
-            std::cout << "[EXTRACT] Found potential persona line" << std::endl;
+        return done;
+    }
+
+    // Call with the final output; also considers an unterminated last line
+    std::string_view result(std::string_view text) {
+        if (!done && line_start < text.size()) check_line(text, line_start, text.size());
+        return text.substr(std::min(best_begin, text.size()), best_len);
+    }
+
+    bool found() const { return done; }
+
+    // For best-of-N: 2 for a persona line led by the name, 1 for a best
+    // guess, 0 for nothing usable
+    double score(std::string_view text) {
+        if (result(text).empty()) return 0.0;
+        return done ? 2.0 : 1.0;
+    }
+
+private:
+    static constexpr const char* kTrim = " \n\r\t\"";
+
+    // Judges text[begin, end) with the quotes and whitespace trimmed
+    void check_line(std::string_view text, size_t begin, size_t end) {
+        std::string_view raw = text.substr(begin, end - begin);
+        const size_t b = raw.find_first_not_of(kTrim);
+        if (b == std::string_view::npos) return;
+        std::string_view line = raw.substr(b, raw.find_last_not_of(kTrim) - b + 1);
+        // Skip code fences and an echoed "Persona:" label
+        if (line == "```" || line.find("Persona:") != std::string_view::npos) return;
+        if (line.size() <= 50) return;
+        if (line.compare(0, name.size(), name) == 0) {
+            best_begin = begin + b;
+            best_len = line.size();
+            done = true;
+        } else if (line.find('(') != std::string_view::npos && line.find(')') != std::string_view::npos) {
+            best_begin = begin + b;
+            best_len = line.size();
         }
     }
-    
-    std::cout << "[EXTRACT] Processed " << line_count << " lines" << std::endl;
-    
-    return best_line;
-}
+
+    const std::string name;
+    size_t scanned = 0;         // bytes of output looked at so far
+    size_t line_start = 0;      // start of the line being generated
+    size_t best_begin = 0;
+    size_t best_len = 0;
+    bool done = false;
+};
 
 std::string create_fallback_persona(const json& input_json) {
     std::string name = input_json["name"];
@@ -336,7 +1214,8 @@ std::string create_fallback_persona(const json& input_json) {
            ". Professional tone inferred from writing samples. Direct communication style.";
 }
 
-std::optional<std::string> send_to_api(const std::string& text, const std::string& api_url) {
+std::optional<std::string> send_to_api(const std::string& text, const std::string& api_url,
+                                       const std::string& traceparent = "") {
     try {
         std::cout << "[API] Attempting to send to: " << api_url << std::endl;
         
@@ -347,7 +1226,9 @@ std::optional<std::string> send_to_api(const std::string& text, const std::strin
         json payload = {{"text", text}};
         std::string body = payload.dump();
 
-        auto res = cli.Post("/ai/profile/persona", body, "application/json");
+        httplib::Headers headers;
+        if (!traceparent.empty()) headers.emplace("traceparent", traceparent);
+        auto res = cli.Post("/ai/profile/persona", headers, body, "application/json");
         if (res && res->status == 200) {
             std::cout << "[API] Success: " << res->body << std::endl;
             return res->body;
@@ -361,32 +1242,702 @@ std::optional<std::string> send_to_api(const std::string& text, const std::strin
     }
 }
 
+// ---------------------------------------------------------------------------
+// Router mode (--router): this process loads no model. It spawns N worker
+// copies of itself on local ports, each pinned to its own set of cores, and
+// forwards persona requests to them. Requests from the same user_id go to
+// the same worker while it isn't much busier than the least loaded one, so
+// per-user state stays warm on one worker; otherwise the worker with the
+// fewest outstanding tokens gets the request.
+// ---------------------------------------------------------------------------
+
+// Parses a Linux cpulist such as "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// CPUs of each NUMA node that this process may run on
+std::vector<std::vector<int>> numa_node_cpus() {
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0;; ++node) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!f) break;
+        std::string list;
+        std::getline(f, list);
+        nodes.push_back(parse_cpu_list(list));
+    }
+    return nodes;
+}
+
+std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+class WorkerRouter {
+public:
+    struct Options {
+        std::string exe;                        // binary to run as the worker
+        std::vector<std::string> worker_args;   // forwarded to every worker
+        std::vector<std::vector<int>> cpu_sets; // one per worker, empty = unpinned
+        int base_port = 8090;
+        std::string capture_path;               // per-worker suffix is added
+        long affinity_slack_tokens = 2048;
+        // How long stop() waits for the workers' own grace and drain before
+        // killing them; derived from the forwarded --shutdown-grace and
+        // --drain-timeout
+        std::chrono::seconds stop_timeout{40};
+    };
+
+    explicit WorkerRouter(Options options) : options(std::move(options)) {
+        workers.resize(this->options.cpu_sets.size());
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].index = (int)i;
+            workers[i].port = this->options.base_port + (int)i;
+            workers[i].cpus = this->options.cpu_sets[i];
+        }
+    }
+
+    ~WorkerRouter() { stop(); }
+
+    WorkerRouter(const WorkerRouter&) = delete;
+    WorkerRouter& operator=(const WorkerRouter&) = delete;
+
+    void start() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& w : workers) spawn(w);
+        }
+        health_thread = std::thread([this] { health_loop(); });
+    }
+
+    // Stops health checking and asks every worker to drain and exit
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            stopping = true;
+        }
+        health_cv.notify_all();
+        if (health_thread.joinable()) health_thread.join();
+
+        for (auto& w : workers) {
+            if (w.pid > 0) kill(w.pid, SIGTERM);
+        }
+        auto deadline = std::chrono::steady_clock::now() + options.stop_timeout;
+        for (auto& w : workers) {
+            while (w.pid > 0) {
+                pid_t r = waitpid(w.pid, nullptr, WNOHANG);
+                if (r == w.pid || r < 0) {
+                    w.pid = -1;
+                } else if (std::chrono::steady_clock::now() > deadline) {
+                    std::cerr << "[ROUTER] Worker " << w.index << " did not exit, killing it" << std::endl;
+                    kill(w.pid, SIGKILL);
+                    waitpid(w.pid, nullptr, 0);
+                    w.pid = -1;
+                } else {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+            }
+        }
+    }
+
+    // Picks a worker for a request expected to cost `tokens`; -1 if none is healthy
+    int acquire(const std::string& user_id, long tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Worker* least = nullptr;
+        Worker* affine = nullptr;
+        uint64_t best_score = 0;
+        for (auto& w : workers) {
+            if (!w.healthy) continue;
+            if (!least || w.outstanding_tokens < least->outstanding_tokens) least = &w;
+            if (!user_id.empty()) {
+                // Rendezvous hashing: a user only moves if their worker goes away
+                uint64_t score = fnv1a64(&w.index, sizeof(w.index), fnv1a64(user_id.data(), user_id.size()));
+                if (!affine || score > best_score) {
+                    affine = &w;
+                    best_score = score;
+                }
+            }
+        }
+        if (!least) return -1;
+        Worker* chosen = least;
+        if (affine && affine->outstanding_tokens <= least->outstanding_tokens + options.affinity_slack_tokens) {
+            chosen = affine;
+            ++affinity_hits;
+        }
+        chosen->outstanding_tokens += tokens;
+        ++chosen->requests_total;
+        return chosen->index;
+    }
+
+    void release(int index, long tokens, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Worker& w = workers[index];
+        w.outstanding_tokens -= tokens;
+        if (!ok) ++w.failures;
+    }
+
+    int port(int index) const { return workers[index].port; }
+
+    bool any_healthy() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& w : workers) {
+            if (w.healthy) return true;
+        }
+        return false;
+    }
+
+    std::vector<int> ports() const {
+        std::vector<int> out;
+        for (const auto& w : workers) out.push_back(w.port);
+        return out;
+    }
+
+    json metrics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        json list = json::array();
+        for (const auto& w : workers) {
+            list.push_back({
+                {"index", w.index},
+                {"port", w.port},
+                {"pid", w.pid},
+                {"cpus", format_cpu_list(w.cpus)},
+                {"healthy", w.healthy},
+                {"outstanding_tokens", w.outstanding_tokens},
+                {"requests_total", w.requests_total},
+                {"failures", w.failures},
+                {"restarts", w.restarts}
+            });
+        }
+        return json{{"workers", list}, {"affinity_hits", affinity_hits}};
+    }
+
+private:
+    struct Worker {
+        int index = 0;
+        int port = 0;
+        std::vector<int> cpus;
+        pid_t pid = -1;
+        bool healthy = false;
+        int failed_checks = 0;
+        int restarts = 0;
+        long outstanding_tokens = 0;
+        uint64_t requests_total = 0;
+        uint64_t failures = 0;
+        std::chrono::steady_clock::time_point exited_at;
+    };
+
+    // fork + exec rather than posix_spawn so the child can pin itself before
+    // exec; everything the child touches is prepared beforehand
+    void spawn(Worker& w) {
+        std::vector<std::string> args = {options.exe, "--port", std::to_string(w.port)};
+        if (!w.cpus.empty()) {
+            args.push_back("--threads");
+            args.push_back(std::to_string(w.cpus.size()));
+        }
+        // Later arguments win, so explicit worker args override the defaults above
+        args.insert(args.end(), options.worker_args.begin(), options.worker_args.end());
+        if (!options.capture_path.empty()) {
+            args.push_back("--capture-file");
+            args.push_back(options.capture_path + ".worker" + std::to_string(w.index));
+        }
+        std::vector<char*> c_args;
+        for (auto& a : args) c_args.push_back(const_cast<char*>(a.c_str()));
+        c_args.push_back(nullptr);
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : w.cpus) CPU_SET(cpu, &set);
+        const bool pin = !w.cpus.empty();
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (pin) sched_setaffinity(0, sizeof(set), &set);
+            sigprocmask(SIG_SETMASK, &no_signals, nullptr);
+            execv(c_args[0], c_args.data());
+            _exit(127);
+        }
+        if (pid < 0) {
+            std::cerr << "[ROUTER] fork failed for worker " << w.index << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        w.pid = pid;
+        w.healthy = false;
+        w.failed_checks = 0;
+        std::cout << "[ROUTER] Worker " << w.index << " started (pid " << pid << ", port " << w.port
+                  << ", cpus " << (pin ? format_cpu_list(w.cpus) : std::string("any")) << ")" << std::endl;
+    }
+
+    void health_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            health_cv.wait_for(lock, std::chrono::seconds(1), [this] { return stopping; });
+            if (stopping) break;
+
+            // Reap and respawn crashed workers, backing off on repeated crashes
+            auto now = std::chrono::steady_clock::now();
+            for (auto& w : workers) {
+                if (w.pid > 0 && waitpid(w.pid, nullptr, WNOHANG) == w.pid) {
+                    std::cerr << "[ROUTER] Worker " << w.index << " (pid " << w.pid << ") exited" << std::endl;
+                    w.pid = -1;
+                    w.healthy = false;
+                    w.exited_at = now;
+                }
+                if (w.pid < 0 && now - w.exited_at >= std::chrono::seconds(std::min(30, 1 << std::min(w.restarts, 5)))) {
+                    ++w.restarts;
+                    spawn(w);
+                }
+            }
+
+            std::vector<int> ports_to_check;
+            for (const auto& w : workers) ports_to_check.push_back(w.pid > 0 ? w.port : -1);
+            lock.unlock();
+            std::vector<bool> ok(ports_to_check.size(), false);
+            for (size_t i = 0; i < ports_to_check.size(); ++i) {
+                if (ports_to_check[i] < 0) continue;
+                httplib::Client cli("127.0.0.1", ports_to_check[i]);
+                cli.set_connection_timeout(1);
+                cli.set_read_timeout(1);
+                auto res = cli.Get("/health");
+                ok[i] = res && res->status == 200;
+            }
+            lock.lock();
+
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker& w = workers[i];
+                if (ports_to_check[i] < 0 || w.pid < 0) continue;
+                if (ok[i]) {
+                    if (!w.healthy) std::cout << "[ROUTER] Worker " << w.index << " is healthy" << std::endl;
+                    w.healthy = true;
+                    w.failed_checks = 0;
+                } else if (w.healthy && ++w.failed_checks >= 3) {
+                    std::cerr << "[ROUTER] Worker " << w.index << " failed 3 health checks" << std::endl;
+                    w.healthy = false;
+                }
+            }
+        }
+    }
+
+    Options options;
+    std::vector<Worker> workers;
+    uint64_t affinity_hits = 0;
+    bool stopping = false;
+    mutable std::mutex mutex;
+    std::condition_variable health_cv;
+    std::thread health_thread;
+};
+
+// Sums the numeric leaves that are meaningful across workers
+json aggregate_worker_metrics(const std::vector<json>& per_worker) {
+    static const std::vector<std::pair<std::string, std::string>> summed = {
+        {"scheduler", "active_sequences"},
+        {"scheduler", "queued_requests"},
+        {"scheduler", "max_sequences"},
+        {"kv_slots", "cells_total"},
+        {"kv_slots", "cells_reserved"},
+        {"kv_slots", "admissions_deferred"},
+        {"kv_cache", "bytes_total"}
+    };
+    json totals = json::object();
+    for (const auto& [section, key] : summed) {
+        double sum = 0.0;
+        for (const auto& m : per_worker) {
+            if (m.contains(section) && m[section].contains(key) && m[section][key].is_number()) {
+                sum += m[section][key].get<double>();
+            }
+        }
+        totals[section + "." + key] = sum;
+    }
+    return totals;
+}
+
+int run_router(int argc, char* argv[]) {
+    int port = 8080;
+    int n_workers = 0;
+    int base_port = 8090;
+    std::string cpu_spec;
+    bool numa = false;
+    long affinity_slack = 2048;
+    std::string capture_path;
+    int drain_timeout_sec = 30;
+    int shutdown_grace_sec = 0;
+    std::vector<std::string> worker_args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--router") {
+            continue;
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = std::stoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            n_workers = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--worker-base-port" && i + 1 < argc) {
+            base_port = std::stoi(argv[++i]);
+        } else if (arg == "--worker-cpus" && i + 1 < argc) {
+            cpu_spec = argv[++i];
+        } else if (arg == "--numa") {
+            numa = true;
+        } else if (arg == "--affinity-slack" && i + 1 < argc) {
+            affinity_slack = std::stol(argv[++i]);
+        } else if (arg == "--capture-file" && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (arg == "--drain-timeout" && i + 1 < argc) {
+            drain_timeout_sec = std::stoi(argv[++i]);
+            worker_args.push_back(arg);
+            worker_args.push_back(argv[i]);
+        } else if (arg == "--shutdown-grace" && i + 1 < argc) {
+            shutdown_grace_sec = std::stoi(argv[++i]);
+            worker_args.push_back(arg);
+            worker_args.push_back(argv[i]);
+        } else {
+            worker_args.push_back(arg);
+        }
+    }
+
+    // Core sets: explicit ("0-7:8-15"), one NUMA node each, or an even split
+    std::vector<std::vector<int>> cpu_sets;
+    if (!cpu_spec.empty()) {
+        std::stringstream ss(cpu_spec);
+        std::string list;
+        while (std::getline(ss, list, ':')) cpu_sets.push_back(parse_cpu_list(list));
+        if (n_workers == 0) n_workers = (int)cpu_sets.size();
+        if ((int)cpu_sets.size() != n_workers) {
+            throw std::runtime_error("--worker-cpus lists " + std::to_string(cpu_sets.size()) +
+                                     " core sets for " + std::to_string(n_workers) + " workers");
+        }
+    } else if (numa) {
+        auto nodes = numa_node_cpus();
+        if (nodes.empty()) throw std::runtime_error("--numa: no NUMA nodes found in /sys");
+        if (n_workers == 0) n_workers = (int)nodes.size();
+        for (int i = 0; i < n_workers; ++i) cpu_sets.push_back(nodes[i % nodes.size()]);
+    } else {
+        if (n_workers == 0) n_workers = 2;
+        auto cpus = allowed_cpus();
+        const size_t per_worker = cpus.size() / n_workers;
+        for (int i = 0; i < n_workers; ++i) {
+            if (per_worker == 0) {
+                cpu_sets.emplace_back();    // fewer cores than workers: don't pin
+                continue;
+            }
+            cpu_sets.emplace_back(cpus.begin() + i * per_worker, cpus.begin() + (i + 1) * per_worker);
+        }
+    }
+
+    std::cout << "========================================" << std::endl;
+    std::cout << "Persona Router (" << n_workers << " workers)" << std::endl;
+    std::cout << "========================================" << std::endl;
+
+    ShutdownCoordinator shutdown;
+    shutdown.start(std::chrono::seconds(shutdown_grace_sec), std::chrono::seconds(drain_timeout_sec));
+
+    char exe[4096];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0) throw std::runtime_error("Cannot resolve /proc/self/exe");
+    exe[len] = '\0';
+
+    WorkerRouter::Options options;
+    options.exe = exe;
+    options.worker_args = worker_args;
+    options.cpu_sets = cpu_sets;
+    options.base_port = base_port;
+    options.capture_path = capture_path;
+    options.affinity_slack_tokens = affinity_slack;
+    // Workers drain on their own; give them a little longer than that
+    options.stop_timeout = std::chrono::seconds(shutdown_grace_sec + drain_timeout_sec + 10);
+    WorkerRouter router(options);
+    router.start();
+    shutdown.on_flush("workers", [&router] { router.stop(); });
+
+    httplib::Server svr;
+    HttpTuning http_tuning;
+    http_tuning.default_body_limit = 10 * 1024 * 1024;
+    apply_http_tuning(svr, http_tuning);
+    svr.new_task_queue = [] { return new ElasticTaskQueue(8, 512); };
+    shutdown.on_stop([&svr] { svr.stop(); });
+
+    svr.Get("/health", [&router, &shutdown](const httplib::Request&, httplib::Response& res) {
+        if (shutdown.draining() || !router.any_healthy()) {
+            res.status = 503;
+            res.set_content(shutdown.draining() ? "{\"status\":\"draining\"}" : "{\"status\":\"no healthy workers\"}",
+                            "application/json");
+            return;
+        }
+        res.set_content("{\"status\":\"ok\"}", "application/json");
+    });
+
+    svr.Get("/metrics", [&router](const httplib::Request&, httplib::Response& res) {
+        std::vector<json> per_worker;
+        for (int worker_port : router.ports()) {
+            httplib::Client cli("127.0.0.1", worker_port);
+            cli.set_connection_timeout(1);
+            cli.set_read_timeout(2);
+            auto r = cli.Get("/metrics");
+            json m = json::object();
+            if (r && r->status == 200) {
+                try {
+                    m = json::parse(r->body);
+                } catch (const json::parse_error&) {
+                }
+            }
+            per_worker.push_back(std::move(m));
+        }
+        json out = {
+            {"router", router.metrics()},
+            {"totals", aggregate_worker_metrics(per_worker)},
+            {"per_worker", per_worker}
+        };
+        res.set_content(out.dump(), "application/json");
+    });
+
+    svr.Post("/ai/profile/persona", [&router](const httplib::Request& req, httplib::Response& res) {
+        std::string user_id;
+        try {
+            json body = json::parse(req.body);
+            if (body.contains("user_id") && body["user_id"].is_string()) user_id = body["user_id"];
+        } catch (const json::parse_error&) {
+            // The worker answers malformed requests with the usual 400
+        }
+        // Rough cost: ~4 bytes per prompt token plus the generation budget
+        const long tokens = (long)(req.body.size() / 4) + 256;
+
+        int worker = router.acquire(user_id, tokens);
+        if (worker < 0) {
+            res.status = 503;
+            res.set_content("{\"error\":\"No healthy workers\"}", "application/json");
+            return;
+        }
+        httplib::Client cli("127.0.0.1", router.port(worker));
+        cli.set_connection_timeout(2);
+        cli.set_read_timeout(600);
+        httplib::Headers headers;
+        if (req.has_header("traceparent")) headers.emplace("traceparent", req.get_header_value("traceparent"));
+        auto r = cli.Post(req.path, headers, req.body, "application/json");
+        router.release(worker, tokens, (bool)r);
+        if (!r) {
+            res.status = 502;
+            res.set_content("{\"error\":\"Worker " + std::to_string(worker) + " did not respond\"}", "application/json");
+            return;
+        }
+        res.status = r->status;
+        if (r->has_header("Server-Timing")) res.set_header("Server-Timing", r->get_header_value("Server-Timing"));
+        res.set_header("X-Worker", std::to_string(worker));
+        res.set_content(r->body, r->get_header_value("Content-Type"));
+    });
+
+    std::cout << "[ROUTER] Listening on port " << port << ", workers on "
+              << base_port << "-" << base_port + n_workers - 1 << std::endl;
+    if (!shutdown.draining()) svr.listen("0.0.0.0", port);
+    shutdown.finish();
+    std::cout << "[SHUTDOWN] Router drained, exiting" << std::endl;
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     try {
+        for (int i = 1; i < argc; i++) {
+            if (std::string(argv[i]) == "--router") return run_router(argc, argv);
+        }
+
         std::string model_path = "../build/models/google_gemma-3-1b-it-qat-q4_0-gguf_gemma-3-1b-it-q4_0.gguf";
-        if (argc > 1) {
-            model_path = argv[1];
+        KvCacheConfig kv_config;
+        int n_threads = 4;
+        size_t http_max_threads = 256;
+        HttpTuning http_tuning;
+        int drain_timeout_sec = 30;
+        int shutdown_grace_sec = 0;
+        int port = 8080;
+        http_tuning.default_body_limit = 10 * 1024 * 1024;
+        std::string capture_path;
+        std::vector<std::pair<std::string, std::string>> language_routes;  // languages, model path
+        bool fill_persona = false;     // opt in with --persona-mode fill
+        int persona_samples = 1;
+        Tracer::Config trace_config;
+        trace_config.service_name = "llama_api_server";
+
+        // Parse command line arguments; a bare argument is the model path
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--cache-type-k" && i + 1 < argc) {
+                kv_config.type_k = parse_kv_cache_type(argv[++i]);
+            } else if (arg == "--cache-type-v" && i + 1 < argc) {
+                kv_config.type_v = parse_kv_cache_type(argv[++i]);
+            } else if (arg == "--kv-budget-mb" && i + 1 < argc) {
+                kv_config.budget_bytes = std::stoull(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--ctx-per-seq" && i + 1 < argc) {
+                kv_config.ctx_per_seq = std::stoi(argv[++i]);
+            } else if (arg == "--max-sequences" && i + 1 < argc) {
+                kv_config.max_sequences = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--threads" && i + 1 < argc) {
+                n_threads = std::stoi(argv[++i]);
+            } else if (arg == "--http-max-threads" && i + 1 < argc) {
+                http_max_threads = std::stoul(argv[++i]);
+            } else if (arg == "--keep-alive-max" && i + 1 < argc) {
+                http_tuning.keep_alive_max_count = std::stoul(argv[++i]);
+            } else if (arg == "--keep-alive-timeout" && i + 1 < argc) {
+                http_tuning.keep_alive_timeout_sec = std::stol(argv[++i]);
+            } else if (arg == "--gzip-min-bytes" && i + 1 < argc) {
+                http_tuning.gzip_min_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--body-limit-kb" && i + 1 < argc) {
+                http_tuning.set_body_limit(argv[++i]);
+            } else if (arg == "--drain-timeout" && i + 1 < argc) {
+                drain_timeout_sec = std::stoi(argv[++i]);
+            } else if (arg == "--shutdown-grace" && i + 1 < argc) {
+                shutdown_grace_sec = std::stoi(argv[++i]);
+            } else if (arg == "--port" && i + 1 < argc) {
+                port = std::stoi(argv[++i]);
+            } else if (arg == "--capture-file" && i + 1 < argc) {
+                capture_path = argv[++i];
+            } else if (arg == "--persona-mode" && i + 1 < argc) {
+                // "fill": sample only tone and style; "generate": the whole line
+                std::string mode = argv[++i];
+                if (mode != "fill" && mode != "generate") {
+                    throw std::runtime_error("Invalid --persona-mode (expected fill or generate): " + mode);
+                }
+                fill_persona = mode == "fill";
+            } else if (arg == "--persona-samples" && i + 1 < argc) {
+                // Best-of-N in --persona-mode generate
+                persona_samples = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--language-model" && i + 1 < argc) {
+                // "ja,zh,ko=/models/qwen.gguf"
+                std::string spec = argv[++i];
+                size_t eq = spec.find('=');
+                if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size()) {
+                    throw std::runtime_error("Invalid --language-model (expected LANGS=PATH): " + spec);
+                }
+                language_routes.emplace_back(spec.substr(0, eq), spec.substr(eq + 1));
+            } else if (arg == "--otlp-endpoint" && i + 1 < argc) {
+                trace_config.endpoint = argv[++i];
+            } else if (arg == "--trace-sample-ratio" && i + 1 < argc) {
+                trace_config.sample_ratio = std::stod(argv[++i]);
+            } else if (!arg.empty() && arg[0] == '-') {
+                throw std::runtime_error("Unknown option (or missing value): " + arg);
+            } else {
+                model_path = arg;
+            }
         }
         
         std::cout << "========================================" << std::endl;
         std::cout << "Persona Generation Server (Debug Mode)" << std::endl;
         std::cout << "========================================" << std::endl;
         
-        LlamaInference llama(model_path);
+        // Before any thread is started: they all inherit the blocked signals
+        ShutdownCoordinator shutdown;
+        shutdown.start(std::chrono::seconds(shutdown_grace_sec), std::chrono::seconds(drain_timeout_sec));
+        
+        RequestCaptureLog capture_log;
+        if (!capture_path.empty()) {
+            capture_log.open(capture_path);
+            std::cout << "[INIT] Capturing requests to: " << capture_path << std::endl;
+        }
+        shutdown.on_flush("capture log", [&capture_log] { capture_log.close(); });
+
+        Tracer tracer;
+        if (!trace_config.endpoint.empty()) {
+            std::cout << "[INIT] Exporting traces to: " << trace_config.endpoint
+                      << " (sample ratio " << trace_config.sample_ratio << ")" << std::endl;
+            tracer.start(trace_config);
+        }
+        shutdown.on_flush("trace export", [&tracer] { tracer.stop(); });
+
+        LanguageModels models(model_path, language_routes, kv_config, n_threads);
         
         httplib::Server svr;
+        apply_http_tuning(svr, http_tuning);
+        shutdown.on_stop([&svr] { svr.stop(); });
+        // Every sequence slot needs a connection thread waiting on it; the
+        // queue grows past that so /health and /metrics never wait behind
+        // generations
+        const size_t n_http_threads = models.max_sequences() + 4;
+        std::atomic<ElasticTaskQueue*> http_queue{nullptr};
+        svr.new_task_queue = [&http_queue, n_http_threads, http_max_threads] {
+            auto* queue = new ElasticTaskQueue(n_http_threads, http_max_threads);
+            http_queue = queue;
+            return queue;
+        };
         
-        svr.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+        // Load balancers stop routing here once a drain has started
+        svr.Get("/health", [&shutdown](const httplib::Request&, httplib::Response& res) {
+            if (shutdown.draining()) {
+                res.status = 503;
+                res.set_content("{\"status\":\"draining\"}", "application/json");
+                return;
+            }
             res.set_content("{\"status\":\"ok\"}", "application/json");
         });
+
+        svr.Get("/metrics", [&models, &http_queue](const httplib::Request&, httplib::Response& res) {
+            json metrics = models.metrics();
+            auto arena_stats = RequestArena::stats();
+            metrics["request_arena"] = {
+                {"requests", arena_stats.requests},
+                {"spilled", arena_stats.spilled},
+                {"spilled_bytes", arena_stats.spilled_bytes}
+            };
+            if (ElasticTaskQueue* queue = http_queue.load()) {
+                auto stats = queue->stats();
+                metrics["http"] = {
+                    {"threads", stats.threads},
+                    {"threads_idle", stats.idle},
+                    {"threads_peak", stats.peak_threads},
+                    {"threads_min", stats.min_threads},
+                    {"threads_max", stats.max_threads},
+                    {"connections_queued", stats.queued},
+                    {"connections_total", stats.connections}
+                };
+            }
+            res.set_content(metrics.dump(), "application/json");
+        });
         
-        svr.Post("/ai/profile/persona", [&llama](const httplib::Request& req, httplib::Response& res) {
+        svr.Post("/ai/profile/persona", [&models, &capture_log, &tracer, fill_persona, persona_samples](const httplib::Request& req, httplib::Response& res) {
             std::cout << "\n========================================" << std::endl;
             std::cout << "NEW REQUEST RECEIVED" << std::endl;
             std::cout << "========================================" << std::endl;
             
+            RequestTimings timings;
+            RequestArena arena;     // scratch for prompt building
+            RequestTimings::HeaderScope<httplib::Response> timing_header(timings, res);
+            CaptureScope capture(capture_log, timings, res.status, req.path, req.body);
+            TraceScope trace(tracer, timings, res.status, req.method, req.path,
+                             req.get_header_value("traceparent"));
+            
             try {
-                json input_json = json::parse(req.body);
+                json input_json;
+                {
+                    RequestTimings::Scope stage(timings, "parse");
+                    input_json = json::parse(req.body);
+                }
                 
                 std::cout << "[REQUEST] Body: " << input_json.dump(2) << std::endl;
                 
@@ -406,17 +1957,56 @@ int main(int argc, char* argv[]) {
                 
                 std::cout << "[REQUEST] Processing for user: " << name << " (ID: " << user_id << ")" << std::endl;
                 
-                std::string prompt = create_persona_prompt(input_json);
-                std::cout << "[REQUEST] Prompt created (" << prompt.length() << " chars)" << std::endl;
+                PromptParts prompt = create_persona_prompt(input_json, arena.resource());
+                const std::string language = language_code(input_json["language"]);
+                LlamaInference& llama = models.for_language(language);
+                std::cout << "[REQUEST] Prompt created (" << prompt.size() << " parts), language " << language
+                          << " -> " << llama.path() << std::endl;
                 
-                std::string raw_output = llama.generate(prompt, 256);  // Reduced max_tokens
+                // An explicit seed (e.g. from llama_replay) makes sampling reproducible
+                SamplingParams sampling;
+                sampling.seed = input_json.contains("seed") ? input_json["seed"].get<uint32_t>() : random_seed();
+                const int max_tokens = 256;  // Reduced max_tokens
+                capture.record.seed = sampling.seed;
+                capture.record.temperature = sampling.temperature;
+                capture.record.top_p = sampling.top_p;
+                capture.record.top_k = sampling.top_k;
+                capture.record.max_tokens = max_tokens;
+                
+                // The persona is one line; stop at its end instead of
+                // generating filler that extraction throws away. In
+                // slot-filling mode only tone and style are generated.
+                GenerateOptions options;
+                std::vector<PersonaExtractor> extractors(fill_persona ? 1 : persona_samples, PersonaExtractor(name));
+                int chosen = 0;
+                if (fill_persona) {
+                    options.fill = persona_fill_steps(input_json);
+                } else {
+                    // Best-of-N: each sample has its own extractor, and one
+                    // with a name-led persona line beats a best guess
+                    options.stops = {"\n", "```"};
+                    options.on_text = [&extractors](int sample, std::string_view text) {
+                        return extractors[sample].feed(text);
+                    };
+                    options.n_samples = persona_samples;
+                    options.score = [&extractors](int sample, std::string_view text) {
+                        return extractors[sample].score(text);
+                    };
+                    options.chosen_sample = &chosen;
+                }
+                std::string raw_output = llama.generate(prompt, max_tokens, sampling, &timings, std::move(options));
+                PersonaExtractor& extractor = extractors[chosen];
                 
                 std::cout << "\n[OUTPUT] Raw generated output:" << std::endl;
                 std::cout << "----------------------------------------" << std::endl;
                 std::cout << raw_output << std::endl;
                 std::cout << "----------------------------------------" << std::endl;
                 
-                std::string persona_string = extract_persona_line(raw_output, name);
+                std::string persona_string;
+                {
+                    RequestTimings::Scope stage(timings, "extract");
+                    persona_string = std::string(extractor.result(raw_output));
+                }
                 
                 if (persona_string.empty() || persona_string.length() < 20) {
                     persona_string = create_fallback_persona(input_json);
@@ -429,7 +2019,10 @@ int main(int argc, char* argv[]) {
                 
                 // Optional external API call
                 std::string target_api = "http://localhost:8081";
-                send_to_api(persona_string, target_api);
+                {
+                    RequestTimings::Scope stage(timings, "send_to_api");
+                    send_to_api(persona_string, target_api, trace.traceparent());
+                }
                 
                 json output_json = {
                     {"user_id", user_id},
@@ -450,13 +2043,17 @@ int main(int argc, char* argv[]) {
             }
         });
         
-        std::cout << "\n[SERVER] Starting on port 8080..." << std::endl;
+        std::cout << "\n[SERVER] Starting on port " << port << "..." << std::endl;
         std::cout << "[SERVER] Endpoints:" << std::endl;
         std::cout << "  - POST /ai/profile/persona" << std::endl;
         std::cout << "  - GET  /health" << std::endl;
+        std::cout << "  - GET  /metrics" << std::endl;
         std::cout << "========================================\n" << std::endl;
         
-        svr.listen("0.0.0.0", 8080);
+        // Returns after a shutdown signal, once in-flight requests are done
+        if (!shutdown.draining()) svr.listen("0.0.0.0", port);
+        shutdown.finish();
+        std::cout << "[SHUTDOWN] Drained, exiting" << std::endl;
         
     } catch (const std::exception& e) {
         std::cerr << "[FATAL] " << e.what() << std::endl;
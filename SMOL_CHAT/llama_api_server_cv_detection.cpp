@@ -1,5 +1,17 @@
 #include "httplib.h"
 #include <nlohmann/json.hpp>
+#include "classification_cache.h"
+#include "document_fingerprint.h"
+#include "email_thread.h"
+#include "image_preprocess.h"
+#include "page_render_cache.h"
+#include "http_task_queue.h"
+#include "http_tuning.h"
+#include "request_arena.h"
+#include "request_capture.h"
+#include "request_timing.h"
+#include "shutdown.h"
+#include "tracing.h"
 #include <string>
 #include <vector>
 #include <memory>
@@ -9,6 +21,12 @@
 #include <cstring>
 #include <fstream>
 #include <algorithm> 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
 
 // POSIX/Linux Headers for temp files and directory manipulation
 #include <sys/stat.h>
@@ -17,6 +35,15 @@
 #include <cstdio>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <utime.h>
+#include <cerrno>
+#include <cmath>
+#include <functional>
 
 // For PDF to image conversion
 #include <poppler/cpp/poppler-document.h>
@@ -26,20 +53,179 @@
 
 using json = nlohmann::json;
 
-// Execute command and capture output
-std::string exec_command(const std::string& cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-    
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
+// Result of running a child process. stdout and stderr are captured
+// separately so the model answer never has to be picked out of llama.cpp logs.
+struct ProcessResult {
+    std::string stdout_text;
+    std::string stderr_text;
+    int exit_status = -1;
+    bool terminated_early = false;
+};
+
+// Called with each new chunk of stdout; returning true stops the child.
+using StdoutObserver = std::function<bool(const char* data, size_t len)>;
+
+// Incremental extractor for the first complete top-level JSON object in a
+// byte stream. Tracks string/escape state so braces inside values don't count.
+class JsonObjectScanner {
+public:
+    // Feed the next chunk; returns true once the closing brace has been seen.
+    bool feed(const char* data, size_t len) {
+        for (size_t i = 0; i < len && !done; ++i, ++offset) {
+            char c = data[i];
+            if (depth == 0) {
+                if (c == '{') {
+                    begin = offset;
+                    depth = 1;
+                }
+                continue;
+            }
+            if (in_string) {
+                if (escaped) escaped = false;
+                else if (c == '\\') escaped = true;
+                else if (c == '"') in_string = false;
+                continue;
+            }
+            if (c == '"') in_string = true;
+            else if (c == '{') ++depth;
+            else if (c == '}' && --depth == 0) {
+                end = offset + 1;
+                done = true;
+            }
+        }
+        return done;
     }
-    
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
+
+    bool complete() const { return done; }
+    // Byte offset one past the closing brace, valid once complete().
+    size_t end_offset() const { return end; }
+
+private:
+    size_t offset = 0;
+    size_t begin = 0;
+    size_t end = 0;
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    bool done = false;
+};
+
+// Read whatever is available on fd into the tail of out. Returns false on EOF.
+static bool drain_fd(int fd, std::string& out, size_t& new_bytes) {
+    constexpr size_t kReadSize = 64 * 1024;
+    size_t old_size = out.size();
+    out.resize(old_size + kReadSize);
+    ssize_t n;
+    do {
+        n = read(fd, &out[old_size], kReadSize);
+    } while (n < 0 && errno == EINTR);
+    out.resize(old_size + (n > 0 ? n : 0));
+    new_bytes = n > 0 ? static_cast<size_t>(n) : 0;
+    return n > 0;
+}
+
+// Spawn argv[0] (searched on PATH) without a shell, stream its output and wait
+// for it. If observer returns true the child is terminated right away.
+ProcessResult run_process(const std::vector<std::string>& args, const StdoutObserver& observer = nullptr) {
+    if (args.empty()) {
+        throw std::runtime_error("run_process: empty argv");
     }
-    
+
+    int out_pipe[2];
+    int err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        throw std::runtime_error("pipe() failed: " + std::string(strerror(errno)));
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        throw std::runtime_error("pipe() failed: " + std::string(strerror(errno)));
+    }
+
+    std::vector<char*> c_args;
+    c_args.reserve(args.size() + 1);
+    for (const auto& a : args) c_args.push_back(const_cast<char*>(a.c_str()));
+    c_args.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+
+    // The server blocks SIGINT/SIGTERM for its shutdown watcher; the child
+    // gets a clean mask, and its own process group so a Ctrl-C meant for
+    // the server doesn't kill a generation that is being drained
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    pid_t pid;
+    int spawn_rc = posix_spawnp(&pid, c_args[0], &actions, &attr, c_args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    if (spawn_rc != 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        throw std::runtime_error("posix_spawn(" + args[0] + ") failed: " + std::string(strerror(spawn_rc)));
+    }
+    // The child leads its own group, so a forced exit has to stop it
+    ShutdownCoordinator::track_child(pid);
+
+    ProcessResult result;
+    struct pollfd fds[2] = {
+        {out_pipe[0], POLLIN, 0},
+        {err_pipe[0], POLLIN, 0},
+    };
+    int open_fds = 2;
+
+    while (open_fds > 0) {
+        int rc = poll(fds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            std::string& sink = (i == 0) ? result.stdout_text : result.stderr_text;
+            size_t new_bytes = 0;
+            if (!drain_fd(fds[i].fd, sink, new_bytes)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --open_fds;
+                continue;
+            }
+
+            if (i == 0 && observer &&
+                observer(result.stdout_text.data() + result.stdout_text.size() - new_bytes, new_bytes)) {
+                result.terminated_early = true;
+                kill(pid, SIGTERM);
+                open_fds = 0;
+                break;
+            }
+        }
+    }
+
+    for (auto& f : fds) {
+        if (f.fd >= 0) close(f.fd);
+    }
+
+    // Before the wait, while the zombie still holds the pid, so the group id
+    // can't have been reused by the time it is forgotten
+    ShutdownCoordinator::untrack_child(pid);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    result.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
     return result;
 }
 
@@ -53,10 +239,11 @@ void cleanup_temp_images(const std::vector<std::string>& image_paths) {
 }
 
 std::string get_cli_version(const std::string& llama_cli_path) {
-    std::string version_cmd = llama_cli_path + " --version 2>&1";
     std::string version_output;
     try {
-        version_output = exec_command(version_cmd);
+        // llama.cpp prints its build info on stderr
+        ProcessResult result = run_process({llama_cli_path, "--version"});
+        version_output = result.stdout_text + result.stderr_text;
         size_t first = version_output.find_first_not_of(" \t\n\r");
         size_t last = version_output.find_last_not_of(" \t\n\r");
         if (std::string::npos == first || std::string::npos == last) {
@@ -75,7 +262,34 @@ bool is_pdf_file(const std::string& filename) {
     return ext == ".pdf";
 }
 
-std::string pdf_to_image(const std::string& pdf_path, const std::string& output_dir) {
+// How pages are rendered. Most attachments are black text on white, which
+// renders faster and packs smaller in gray or 1-bit mono.
+enum class RenderMode { Color, Gray, Mono };
+
+const char* render_mode_name(RenderMode mode) {
+    return mode == RenderMode::Color ? "color" : mode == RenderMode::Gray ? "gray" : "mono";
+}
+
+RenderMode parse_render_mode(const std::string& name) {
+    if (name == "color") return RenderMode::Color;
+    if (name == "gray") return RenderMode::Gray;
+    if (name == "mono") return RenderMode::Mono;
+    throw std::runtime_error("--render-mode must be color, gray or mono");
+}
+
+// How rendered pages are handed to llama-mtmd-cli. By default the page is
+// resized to the projector's input size here and written as an uncompressed
+// PPM (PGM for gray and mono), so the CLI neither inflates a PNG nor resizes
+// a full 150 dpi page.
+struct PageImageConfig {
+    bool preprocess = true;     // false: full-size PNG, as before
+    PreprocessConfig size;
+    RenderMode mode = RenderMode::Color;
+    int mono_threshold = 128;   // gray level at or above which a pixel is white
+    PageRenderCache* cache = nullptr;
+};
+
+poppler::image render_first_page(const std::string& pdf_path, RenderMode mode) {
     struct stat pdf_stat;
     if (stat(pdf_path.c_str(), &pdf_stat) != 0) {
          throw std::runtime_error("PDF file not found at: " + pdf_path);
@@ -92,27 +306,390 @@ std::string pdf_to_image(const std::string& pdf_path, const std::string& output_
     }
     
     poppler::page_renderer renderer;
-    renderer.set_render_hint(poppler::page_renderer::text_antialiasing);
-    renderer.set_render_hint(poppler::page_renderer::antialiasing);
+    if (mode == RenderMode::Mono) {
+        // Aliased rendering is already close to two-level, so thresholding
+        // loses little; hinting keeps glyph stems on whole pixels and solid
+        // line mode keeps hairline table rules from vanishing.
+        renderer.set_image_format(poppler::image::format_gray8);
+        renderer.set_render_hint(poppler::page_renderer::text_hinting);
+        renderer.set_line_mode(poppler::page_renderer::line_solid);
+    } else {
+        if (mode == RenderMode::Gray) {
+            renderer.set_image_format(poppler::image::format_gray8);
+            renderer.set_render_hint(poppler::page_renderer::text_hinting);
+        }
+        renderer.set_render_hint(poppler::page_renderer::text_antialiasing);
+        renderer.set_render_hint(poppler::page_renderer::antialiasing);
+    }
     
     poppler::image img = renderer.render_page(page.get(), 150, 150);
     
     if (!img.is_valid()) {
         throw std::runtime_error("Failed to render PDF page to image");
     }
-    
+    return img;
+}
+
+PageBitmap render_page_bitmap(const std::string& pdf_path, const PageImageConfig& config) {
+    poppler::image img = render_first_page(pdf_path, config.mode);
+    const bool color = config.mode == RenderMode::Color;
+    if (img.format() != (color ? poppler::image::format_argb32 : poppler::image::format_gray8)) {
+        throw std::runtime_error("Unexpected page image format from poppler");
+    }
+    const PixelFormat format = color ? PixelFormat::Bgra : config.mode == RenderMode::Gray ? PixelFormat::Gray
+                                                                                          : PixelFormat::Mono;
+    return pack_page(reinterpret_cast<const uint8_t*>(img.const_data()), img.width(), img.height(),
+                     img.bytes_per_row(), color ? PixelFormat::Bgra : PixelFormat::Gray, format,
+                     config.mono_threshold);
+}
+
+// Rendered page from the cache, or rendered now and cached
+std::shared_ptr<const PageBitmap> cached_page_bitmap(const std::string& pdf_path, const PageImageConfig& config) {
+    uint64_t key = 0;
+    if (config.cache && config.cache->enabled()) {
+        const uint8_t mode = (uint8_t)config.mode;
+        key = fnv1a64(&mode, 1, hash_file(pdf_path));
+        if (auto page = config.cache->lookup(key)) {
+            std::cout << "[RENDER] Cache hit for " << pdf_path << std::endl;
+            return page;
+        }
+    }
+    auto page = std::make_shared<const PageBitmap>(render_page_bitmap(pdf_path, config));
+    if (key != 0) config.cache->insert(key, page);
+    return page;
+}
+
+std::string pdf_to_image(const std::string& pdf_path, const std::string& output_dir,
+                         const PageImageConfig& config) {
     std::string base_name = pdf_path.substr(pdf_path.find_last_of("/\\") + 1);
     base_name = base_name.substr(0, base_name.find_last_of('.'));
-    std::string output_path = output_dir + "/" + base_name + "_page1.png";
+    // Attachments render in parallel and requests overlap, and two of them
+    // may carry the same file name, so every output gets its own name
+    static std::atomic<uint64_t> sequence{0};
+    std::string output_path = output_dir + "/" + base_name + "_" + std::to_string(getpid()) + "-" +
+                              std::to_string(sequence.fetch_add(1, std::memory_order_relaxed)) + "_page1";
     
-    if (!img.save(output_path, "png")) {
-        throw std::runtime_error("Failed to save image: " + output_path);
+    if (config.preprocess) {
+        auto page = cached_page_bitmap(pdf_path, config);
+        PixelImage img = preprocess_page(*page, config.size);
+        if (img.source.width != page->width || img.source.height != page->height) {
+            std::cout << "[CROP] " << pdf_path << ": " << page->width << "x" << page->height << " -> "
+                      << img.source.width << "x" << img.source.height << " at " << img.source.x << ","
+                      << img.source.y << std::endl;
+        }
+        output_path += img.channels == 1 ? ".pgm" : ".ppm";
+        write_pnm(img, output_path);
+    } else {
+        poppler::image img = render_first_page(pdf_path, config.mode);
+        output_path += ".png";
+        if (!img.save(output_path, "png")) {
+            throw std::runtime_error("Failed to save image: " + output_path);
+        }
     }
     
     std::cout << "Converted PDF to image: " << output_path << std::endl;
     return output_path;
 }
 
+// --bench-preprocess: renders a PDF in each mode and reports render time,
+// packed size, preprocessing time, and how far the resized gray/mono image
+// is from the color one (PSNR of luminance). With --bench-extract the vision
+// model also runs on every mode's image and the fields are compared with
+// the color result, which is what extraction quality actually means here.
+// Also times the old PNG hand-off and each kernel set against scalar; the
+// CLI's own PNG decode and resize are not included, so the PNG numbers
+// understate what preprocessing saves.
+void bench_preprocess(const std::string& pdf_path, PageImageConfig config,
+                      const std::function<json(const std::string& image_path)>& extract) {
+    using namespace image_preprocess_detail;
+    const int iterations = 10;
+    config.cache = nullptr;
+    auto time_ms = [&](const std::function<void()>& fn) {
+        auto t0 = RequestTimings::clock::now();
+        for (int i = 0; i < iterations; ++i) fn();
+        return RequestTimings::ms_since(t0) / iterations;
+    };
+    auto luminance = [](const PixelImage& img) {
+        std::vector<float> y(img.data.size() / img.channels);
+        for (size_t i = 0; i < y.size(); ++i) {
+            const uint8_t* p = &img.data[i * img.channels];
+            y[i] = img.channels == 1 ? p[0] : 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+        }
+        return y;
+    };
+    std::cout << "[BENCH] " << pdf_path << " -> " << config.size.width << "x" << config.size.height << ", "
+              << iterations << " runs" << std::endl;
+
+    std::vector<float> reference;
+    json reference_fields;
+    for (RenderMode mode : {RenderMode::Color, RenderMode::Gray, RenderMode::Mono}) {
+        config.mode = mode;
+        PageBitmap page;
+        double render_ms = time_ms([&] { page = render_page_bitmap(pdf_path, config); });
+        PixelImage img;
+        const std::string path = std::string("/tmp/bench_preprocess_") + render_mode_name(mode) + ".pnm";
+        double preprocess_ms = time_ms([&] {
+            img = preprocess_page(page, config.size);
+            write_pnm(img, path);
+        });
+        std::vector<float> y = luminance(img);
+        std::cout << "[BENCH] " << render_mode_name(mode) << ": " << page.width << "x" << page.height
+                  << ", render " << render_ms << " ms, packed " << page.bytes() / 1024 << " KiB, preprocess + write "
+                  << preprocess_ms << " ms";
+        if (reference.empty()) {
+            reference = y;
+        } else {
+            double mse = 0;
+            for (size_t i = 0; i < y.size(); ++i) mse += (y[i] - reference[i]) * (y[i] - reference[i]);
+            mse /= y.size();
+            std::cout << ", PSNR vs color " << (mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY) << " dB";
+        }
+        std::cout << std::endl;
+        if (extract) {
+            json fields = extract(path);
+            std::cout << "[BENCH] " << render_mode_name(mode) << " extraction: " << fields.dump() << std::endl;
+            if (mode == RenderMode::Color) {
+                reference_fields = fields;
+            } else {
+                int same = 0, total = 0;
+                for (auto& [key, value] : reference_fields.items()) {
+                    ++total;
+                    if (fields.contains(key) && fields[key] == value) ++same;
+                }
+                std::cout << "[BENCH] " << render_mode_name(mode) << " matches color on " << same << "/" << total
+                          << " fields" << std::endl;
+            }
+        }
+        unlink(path.c_str());
+    }
+
+    config.mode = RenderMode::Color;
+    poppler::image img = render_first_page(pdf_path, config.mode);
+    PageBitmap page = render_page_bitmap(pdf_path, config);
+    const std::string png_path = "/tmp/bench_preprocess.png";
+    const std::string ppm_path = "/tmp/bench_preprocess.ppm";
+    double png_ms = time_ms([&] { img.save(png_path, "png"); });
+    double ppm_ms = time_ms([&] { write_pnm(preprocess_page(page, config.size), ppm_path); });
+    std::cout << "[BENCH] png save:           " << png_ms << " ms" << std::endl;
+    std::cout << "[BENCH] preprocess + ppm:   " << ppm_ms << " ms" << std::endl;
+    Region crop = crop_region(page, config.size);
+    std::cout << "[BENCH] crop: " << crop.width << "x" << crop.height << " at " << crop.x << "," << crop.y << ", "
+              << (int)(100.0 * crop.width * crop.height / ((double)page.width * page.height)) << "% of the page"
+              << (config.size.crop ? "" : " (disabled)") << std::endl;
+
+    std::vector<const Kernels*> kernels = {&scalar_kernels()};
+    if (std::strcmp(best_kernels().name, "scalar") != 0) kernels.push_back(&best_kernels());
+    for (const Kernels* k : kernels) {
+        double rgb_ms = time_ms([&] { preprocess_page(page, config.size, *k); });
+        double tensor_ms = time_ms([&] { preprocess_to_tensor(page, config.size, *k); });
+        double box_ms = time_ms([&] { content_box(page, config.size.crop_threshold, *k); });
+        std::cout << "[BENCH] " << k->name << ": rgb " << rgb_ms << " ms, normalized tensor " << tensor_ms
+                  << " ms, content box " << box_ms << " ms" << std::endl;
+    }
+    unlink(png_path.c_str());
+    unlink(ppm_path.c_str());
+}
+
+// Fixed-size worker pool with its own FIFO queue. Each pipeline stage
+// (page rendering, model decode) gets one, so a slow stage only backs up its
+// own queue and the stages of different requests overlap.
+class StagePool {
+public:
+    StagePool(std::string name, size_t n_workers) : name(std::move(name)) {
+        if (n_workers == 0) n_workers = 1;
+        for (size_t i = 0; i < n_workers; ++i) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~StagePool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    StagePool(const StagePool&) = delete;
+    StagePool& operator=(const StagePool&) = delete;
+
+    template <typename F>
+    auto submit(F&& fn) -> std::future<decltype(fn())> {
+        using R = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.emplace_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+    size_t queued() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    size_t size() const { return workers.size(); }
+    const std::string& stage_name() const { return name; }
+
+private:
+    void worker_loop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::string name;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Render the first page of every PDF attachment on the render stage, the
+// attachments in parallel; those that fail to convert are logged and skipped.
+std::vector<std::string> render_pdf_attachments(const std::vector<std::string>& filenames,
+                                                StagePool& render_stage,
+                                                const PageImageConfig& page_image,
+                                                RequestTimings& timings) {
+    const std::string temp_dir = "../uploads/temp";
+    struct stat st = {0};
+    if (stat(temp_dir.c_str(), &st) == -1) {
+        if (mkdir(temp_dir.c_str(), 0755) != 0) {
+            throw std::runtime_error("Failed to create temp directory");
+        }
+    }
+
+    auto t_render = RequestTimings::clock::now();
+    std::vector<std::pair<std::string, std::future<std::string>>> pending;
+    for (const auto& filename : filenames) {
+        if (!is_pdf_file(filename)) continue;
+        std::string pdf_path = "../uploads/" + filename;
+        pending.emplace_back(filename, render_stage.submit([pdf_path, temp_dir, &page_image] {
+            return pdf_to_image(pdf_path, temp_dir, page_image);
+        }));
+    }
+
+    std::vector<std::string> image_paths;
+    for (auto& [filename, future] : pending) {
+        try {
+            image_paths.push_back(future.get());
+        } catch (const std::exception& e) {
+            std::cerr << "Error converting PDF " << filename << ": " 
+                     << e.what() << std::endl;
+        }
+    }
+    if (!pending.empty()) {
+        timings.add_at("pdf_to_image", t_render, RequestTimings::ms_since(t_render),
+                       std::to_string(image_paths.size()) + " pages");
+    }
+    return image_paths;
+}
+
+// Run a model invocation on the decode stage, recording how long the request
+// waited for a decode worker and how long the model itself ran.
+template <typename F>
+std::string run_on_decode_stage(StagePool& decode_stage, RequestTimings& timings, F&& fn) {
+    auto t_submit = RequestTimings::clock::now();
+    auto t_model = t_submit;
+    double model_ms = 0.0;
+    std::string output = decode_stage.submit([&] {
+        t_model = RequestTimings::clock::now();
+        std::string result = fn();
+        model_ms = RequestTimings::ms_since(t_model);
+        return result;
+    }).get();
+    timings.add_at("queue", t_submit, std::chrono::duration<double, std::milli>(t_model - t_submit).count());
+    timings.add_at("vision_model", t_model, model_ms);
+    return output;
+}
+
+std::string utf8(const poppler::ustring& s) {
+    poppler::byte_array bytes = s.to_utf8();
+    return std::string(bytes.begin(), bytes.end());
+}
+
+// Producer, page size and fonts from the document, and a dHash of the first
+// page rendered as a tiny gray thumbnail, which costs far less than the
+// 150 dpi render
+DocumentFingerprint fingerprint_pdf(const std::string& pdf_path) {
+    std::unique_ptr<poppler::document> doc(poppler::document::load_from_file(pdf_path));
+    if (!doc || doc->is_locked()) {
+        throw std::runtime_error("Cannot open or read PDF: " + pdf_path);
+    }
+    std::unique_ptr<poppler::page> page(doc->create_page(0));
+    if (!page) {
+        throw std::runtime_error("Cannot read first page of PDF");
+    }
+    std::vector<std::string> fonts;
+    for (const auto& font : doc->fonts()) fonts.push_back(font.name());
+    poppler::rectf rect = page->page_rect(poppler::page::media_box);
+
+    poppler::page_renderer renderer;
+    renderer.set_image_format(poppler::image::format_gray8);
+    renderer.set_render_hint(poppler::page_renderer::antialiasing);
+    renderer.set_render_hint(poppler::page_renderer::text_antialiasing);
+    poppler::image img = renderer.render_page(page.get(), 18, 18);
+    if (!img.is_valid() || img.format() != poppler::image::format_gray8) {
+        throw std::runtime_error("Failed to render PDF thumbnail");
+    }
+
+    DocumentFingerprint fp;
+    fp.layout = layout_hash(utf8(doc->get_producer()), utf8(doc->get_creator()), rect.width(), rect.height(),
+                            std::move(fonts));
+    fp.dhash = page_dhash(pack_page(reinterpret_cast<const uint8_t*>(img.const_data()), img.width(), img.height(),
+                                    img.bytes_per_row(), PixelFormat::Gray, PixelFormat::Gray));
+    return fp;
+}
+
+// Template cluster of every PDF attachment (0 for other files and PDFs that
+// can't be read), fingerprinted in parallel on the render stage
+std::vector<uint64_t> assign_templates(const std::vector<std::string>& filenames, StagePool& render_stage,
+                                       TemplateCache& templates, RequestTimings& timings) {
+    std::vector<uint64_t> ids(filenames.size(), 0);
+    if (!templates.enabled()) return ids;
+    auto t_start = RequestTimings::clock::now();
+    std::vector<std::pair<size_t, std::future<DocumentFingerprint>>> pending;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        if (!is_pdf_file(filenames[i])) continue;
+        std::string pdf_path = "../uploads/" + filenames[i];
+        pending.emplace_back(i, render_stage.submit([pdf_path] { return fingerprint_pdf(pdf_path); }));
+    }
+    for (auto& [i, future] : pending) {
+        try {
+            ids[i] = templates.assign(future.get());
+        } catch (const std::exception& e) {
+            std::cerr << "Error fingerprinting " << filenames[i] << ": " << e.what() << std::endl;
+        }
+    }
+    if (!pending.empty()) {
+        timings.add_at("fingerprint", t_start, RequestTimings::ms_since(t_start),
+                       std::to_string(pending.size()) + " documents");
+    }
+    return ids;
+}
+
+// Attachment names and content hashes for the capture log
+std::vector<CapturedAttachment> hash_attachments(const std::vector<std::string>& filenames) {
+    std::vector<CapturedAttachment> out;
+    for (const auto& filename : filenames) {
+        out.push_back({filename, hash_file("../uploads/" + filename)});
+    }
+    return out;
+}
+
 std::string create_cv_detection_prompt() {
     std::string prompt = 
         "You are an AI assistant that extracts information from CV/resume images.\\n\\n"
@@ -134,50 +711,52 @@ std::string create_cv_detection_prompt() {
     return prompt;
 }
 
-std::string create_draft_reply_prompt(const std::string& persona_string, 
+// The draft prompt in two parts: a prefix that depends only on the persona
+// (instructions, persona, output format), so its KV state can be reused
+// across a user's drafts, and the email-specific tail.
+struct DraftPrompt {
+    std::string prefix;
+    std::string tail;
+};
+
+DraftPrompt create_draft_reply_prompt(const std::string& persona_string, 
                                       const std::string& subject,
                                       const std::string& body,
                                       const std::string& instruction,
                                       bool has_attachments) {
-    std::string prompt = 
+    DraftPrompt prompt;
+    prompt.prefix = 
         "You are an AI assistant that drafts email replies based on user persona and instructions.\\n\\n"
         "Persona: " + persona_string + "\\n\\n"
-        "Original Email Subject: " + subject + "\\n"
-        "Original Email Body: " + body + "\\n\\n";
+        "Draft a reply email that:\\n"
+        "1. Matches the persona's tone and language preference\\n"
+        "2. Follows the instruction if one is given, otherwise provides an appropriate response to the original email\\n"
+        "3. References attachment content if relevant\\n"
+        "4. Is professional and appropriate\\n\\n"
+        "Return ONLY valid JSON in this exact format with no additional text:\\n"
+        "{\\n"
+        "  \\\"subject\\\": \\\"Re: [original subject]\\\",\\n"
+        "  \\\"draft_reply\\\": \\\"Your drafted email reply here\\\"\\n"
+        "}\\n\\n";
     
     if (has_attachments) {
-        prompt += "Note: The email contains attachments (images shown above represent PDF content).\\n\\n";
+        prompt.tail += "Note: The email contains attachments (images shown above represent PDF content).\\n\\n";
     }
+    prompt.tail += 
+        "Original Email Subject: " + subject + "\\n"
+        "Original Email Body: " + body + "\\n\\n";
     
     // Only add instruction if it's not empty
     if (!instruction.empty()) {
-        prompt += "Instruction: " + instruction + "\\n\\n";
+        prompt.tail += "Instruction: " + instruction + "\\n\\n";
     }
     
-    prompt += "Draft a reply email that:\\n"
-        "1. Matches the persona's tone and language preference\\n"
-        "2. ";
-    
-    // Adjust prompt based on whether instruction is provided
-    if (!instruction.empty()) {
-        prompt += "Follows the given instruction\\n";
-    } else {
-        prompt += "Provides an appropriate response to the original email\\n";
-    }
-    
-    prompt += "3. References attachment content if relevant\\n"
-        "4. Is professional and appropriate\\n\\n"
-        "Return ONLY valid JSON in this exact format with no additional text:\\n"
-        "{\\n"
-        "  \\\"subject\\\": \\\"Re: [original subject]\\\",\\n"
-        "  \\\"draft_reply\\\": \\\"Your drafted email reply here\\\"\\n"
-        "}\\n\\n"
-        "Output:";
-    
+    prompt.tail += "Output:";
     return prompt;
 }
 
-json parse_cv_metadata(const std::string& model_output) {
+json parse_cv_metadata(const std::string& model_output,
+                       std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
     size_t start_marker = model_output.find("```json");
     if (start_marker == std::string::npos) {
         start_marker = model_output.find('{');
@@ -194,7 +773,7 @@ json parse_cv_metadata(const std::string& model_output) {
     
     if (start_marker != std::string::npos && end_marker != std::string::npos && 
         end_marker > start_marker) {
-        std::string json_str = model_output.substr(start_marker, end_marker - start_marker + 1);
+        std::pmr::string json_str(std::string_view(model_output).substr(start_marker, end_marker - start_marker + 1), mr);
 
         while (!json_str.empty() && 
                (json_str.back() == '`' || json_str.back() == '\n' || 
@@ -225,8 +804,22 @@ json parse_cv_metadata(const std::string& model_output) {
     };
 }
 
+// Whether extracted metadata describes an actual CV: a real name plus
+// skills or a position. Used to learn which templates are CVs.
+bool metadata_looks_like_cv(const json& metadata) {
+    auto real = [&](const char* key) {
+        if (!metadata.contains(key) || !metadata[key].is_string()) return false;
+        std::string v = metadata[key].get<std::string>();
+        for (auto& c : v) c = std::tolower((unsigned char)c);
+        return !v.empty() && v != "unknown" && v != "n/a" && v != "none" && v != "full name" && v != "job title";
+    };
+    const bool skills = metadata.contains("skills") && metadata["skills"].is_array() && !metadata["skills"].empty();
+    return real("name") && (skills || real("position"));
+}
+
 //  Parse draft reply response
-json parse_draft_reply(const std::string& model_output) {
+json parse_draft_reply(const std::string& model_output,
+                       std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
     size_t start_marker = model_output.find("```json");
     if (start_marker == std::string::npos) {
         start_marker = model_output.find('{');
@@ -243,7 +836,7 @@ json parse_draft_reply(const std::string& model_output) {
     
     if (start_marker != std::string::npos && end_marker != std::string::npos && 
         end_marker > start_marker) {
-        std::string json_str = model_output.substr(start_marker, end_marker - start_marker + 1);
+        std::pmr::string json_str(std::string_view(model_output).substr(start_marker, end_marker - start_marker + 1), mr);
 
         while (!json_str.empty() && 
                (json_str.back() == '`' || json_str.back() == '\n' || 
@@ -301,7 +894,9 @@ std::string create_classification_prompt(const std::string& subject,
     
     return prompt;
 }
-json parse_classification(const std::string& model_output) {
+// *parsed is set when the output held valid JSON rather than falling back
+json parse_classification(const std::string& model_output, bool* parsed_ok = nullptr,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource()) {
     size_t start_marker = model_output.find("```json");
     if (start_marker == std::string::npos) {
         start_marker = model_output.find('{');
@@ -318,7 +913,7 @@ json parse_classification(const std::string& model_output) {
     
     if (start_marker != std::string::npos && end_marker != std::string::npos && 
         end_marker > start_marker) {
-        std::string json_str = model_output.substr(start_marker, end_marker - start_marker + 1);
+        std::pmr::string json_str(std::string_view(model_output).substr(start_marker, end_marker - start_marker + 1), mr);
 
         while (!json_str.empty() && 
                (json_str.back() == '`' || json_str.back() == '\n' || 
@@ -360,6 +955,7 @@ json parse_classification(const std::string& model_output) {
             double confidence = parsed.value("confidence", 0.5);
             if (confidence < 0.0) confidence = 0.0;
             if (confidence > 1.0) confidence = 1.0;
+            if (parsed_ok) *parsed_ok = true;
             
             return json{
                 {"category", category},
@@ -377,39 +973,269 @@ json parse_classification(const std::string& model_output) {
         {"confidence", 0.5}
     };
 }
+// Sampling settings passed to llama-mtmd-cli for each endpoint
+struct VisionSampling {
+    float temperature;
+    int n_predict;
+};
+
+const VisionSampling kCvSampling{0.3f, 800};
+const VisionSampling kDraftSampling{0.7f, 1000};
+const VisionSampling kClassifySampling{0.3f, 500};
+
+void capture_sampling(CaptureScope& capture, const VisionSampling& sampling, uint32_t seed) {
+    capture.record.seed = seed;
+    capture.record.temperature = sampling.temperature;
+    capture.record.max_tokens = sampling.n_predict;
+}
+
+// Seed from the request if given (llama_replay sets it), otherwise random
+uint32_t request_seed(const json& input_json) {
+    return input_json.contains("seed") ? input_json["seed"].get<uint32_t>() : random_seed();
+}
+
+// Sum the "<marker> ... <value> ms" figures llama.cpp logs on stderr.
+// Returns the total and how many lines matched.
+static double sum_logged_ms(const std::string& log, const std::string& marker, int& count) {
+    double total = 0.0;
+    count = 0;
+    for (size_t pos = log.find(marker); pos != std::string::npos; pos = log.find(marker, pos + 1)) {
+        size_t eol = log.find('\n', pos);
+        size_t in = log.rfind(" in ", eol);
+        if (in == std::string::npos || in < pos) continue;
+        total += strtod(log.c_str() + in + 4, nullptr);
+        ++count;
+    }
+    return total;
+}
+
+// Parse "llama_perf_context_print: <label> = X ms / N <unit>"
+static bool parse_perf_line(const std::string& log, const std::string& label, double& ms, long& n) {
+    size_t pos = log.find("llama_perf_context_print: " + label);
+    if (pos == std::string::npos) return false;
+    size_t eq = log.find('=', pos);
+    size_t slash = log.find('/', eq);
+    if (eq == std::string::npos || slash == std::string::npos) return false;
+    ms = strtod(log.c_str() + eq + 1, nullptr);
+    n = strtol(log.c_str() + slash + 1, nullptr, 10);
+    return true;
+}
+
+// Split the CLI run into vision encode / prefill / decode where its stderr
+// says so. The perf summary is only printed if the CLI ran to completion,
+// i.e. not when it was stopped early after the JSON answer. The log has
+// durations but no timestamps, so the stages are laid out back to back,
+// ending when the process exited (model loading comes before all of them).
+void record_cli_timings(const std::string& log, RequestTimings::clock::time_point exited_at,
+                        RequestTimings& timings) {
+    std::vector<StageTiming> stages;
+    int n_slices = 0;
+    int n_batches = 0;
+    double encode_ms = sum_logged_ms(log, "image slice encoded", n_slices);
+    double image_decode_ms = sum_logged_ms(log, "image decoded (batch", n_batches);
+    if (n_slices > 0) stages.push_back({"vision_encode", encode_ms, std::to_string(n_slices) + " slices"});
+    if (n_batches > 0) stages.push_back({"image_prefill", image_decode_ms, std::to_string(n_batches) + " batches"});
+
+    double ms;
+    long n;
+    if (parse_perf_line(log, "prompt eval time", ms, n)) {
+        stages.push_back({"prefill", ms, std::to_string(n) + " tokens"});
+    }
+    if (parse_perf_line(log, "       eval time", ms, n)) {
+        stages.push_back({"decode", ms, std::to_string(n) + " tokens"});
+    }
+
+    auto t = exited_at;
+    for (auto it = stages.rbegin(); it != stages.rend(); ++it) {
+        t -= std::chrono::duration_cast<RequestTimings::clock::duration>(
+            std::chrono::duration<double, std::milli>(it->ms));
+        timings.add_at(it->name, t, it->ms, it->detail);
+    }
+}
+
+// Runs a llama CLI command and returns its output, cut off after the first
+// complete JSON object (the CLI is stopped at that point)
+std::string run_model_cli(const std::vector<std::string>& args, RequestTimings& timings) {
+    std::cout << "Command:";
+    for (const auto& a : args) std::cout << " " << a;
+    std::cout << std::endl;
+
+    JsonObjectScanner scanner;
+    ProcessResult result;
+    try {
+        result = run_process(args, [&scanner](const char* data, size_t len) {
+            return scanner.feed(data, len);
+        });
+    } catch (const std::exception& e) {
+        throw std::runtime_error("Failed to execute vision model: " + std::string(e.what()));
+    }
+
+    record_cli_timings(result.stderr_text, RequestTimings::clock::now(), timings);
+
+    if (!result.terminated_early && result.exit_status != 0) {
+        std::cerr << "Vision model exited with status " << result.exit_status << std::endl;
+        std::cerr << "Vision model stderr: " << result.stderr_text << std::endl;
+    }
+
+    std::string output = std::move(result.stdout_text);
+    if (scanner.complete()) {
+        output.resize(scanner.end_offset());
+    }
+    std::cout << "Vision model raw output: " << output << std::endl;
+    return output;
+}
+
+std::string run_vision_model(const std::vector<std::string>& image_paths,
+                             const std::string& prompt,
+                             const VisionSampling& sampling,
+                             uint32_t seed,
+                             RequestTimings& timings,
+                             const std::string& llama_cli_path,
+                             const std::string& main_model_path,
+                             const std::string& mmproj_path) {
+    std::vector<std::string> args = {
+        llama_cli_path,
+        "-m", main_model_path,
+        "--mmproj", mmproj_path,
+    };
+    for (const auto& path : image_paths) {
+        args.push_back("--image");
+        args.push_back(path);
+        std::cout << "  Passing image: " << path << std::endl;
+    }
+    args.insert(args.end(), {
+        "-p", prompt,
+        "--n-gpu-layers", "0",
+        "--temp", std::to_string(sampling.temperature),
+        "-n", std::to_string(sampling.n_predict),
+        "--seed", std::to_string(seed),
+    });
+    return run_model_cli(args, timings);
+}
+
+// Text-only drafts run through llama-cli, which (unlike llama-mtmd-cli) can
+// save and restore KV state with --prompt-cache. Each persona prefix is
+// evaluated once into its own state file; later drafts for that persona load
+// it read-only and only prefill the email-specific tail.
+//
+// llama-cli gets the raw prompt, so the turn markers that llama-mtmd-cli
+// would apply from the chat template are added here. They default to
+// Gemma 3's and must match the main model.
+struct TextCliConfig {
+    std::string cli_path;           // empty = always use the vision CLI
+    std::string cache_dir = "../uploads/prompt_cache";
+    size_t max_cache_files = 64;
+    std::string user_turn = "<start_of_turn>user\\n";
+    std::string end_turn = "<end_of_turn>\\n";
+    std::string model_turn = "<start_of_turn>model\\n";
+};
+
+// Keeps at most max_files state files, dropping the least recently used
+// (by mtime, which is bumped on every use)
+void prune_prompt_cache(const std::string& dir, size_t max_files) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    std::vector<std::pair<time_t, std::string>> files;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bin") != 0) continue;
+        struct stat st;
+        std::string path = dir + "/" + name;
+        if (stat(path.c_str(), &st) == 0) files.emplace_back(st.st_mtime, path);
+    }
+    closedir(d);
+    if (files.size() <= max_files) return;
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i < files.size() - max_files; ++i) unlink(files[i].second.c_str());
+}
+
+std::string run_text_model_with_prefix_cache(const DraftPrompt& prompt,
+                                             const VisionSampling& sampling,
+                                             uint32_t seed,
+                                             RequestTimings& timings,
+                                             const TextCliConfig& text_cli,
+                                             const std::string& main_model_path) {
+    const std::string prefix = text_cli.user_turn + prompt.prefix;
+    const std::string tail = prompt.tail + text_cli.end_turn + text_cli.model_turn;
+
+    if (mkdir(text_cli.cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Failed to create prompt cache directory " + text_cli.cache_dir + ": " +
+                                 std::string(strerror(errno)));
+    }
+    std::string key = main_model_path;
+    key += '\0';
+    key += prefix;
+    char name[32];
+    snprintf(name, sizeof(name), "/draft-%016llx.bin", (unsigned long long)fnv1a64(key.data(), key.size()));
+    const std::string cache_file = text_cli.cache_dir + name;
+
+    const std::vector<std::string> common_args = {
+        text_cli.cli_path,
+        "-m", main_model_path,
+        "-no-cnv",
+        "--no-display-prompt",
+        "--n-gpu-layers", "0",
+        "--seed", std::to_string(seed),
+    };
+
+    struct stat st;
+    if (stat(cache_file.c_str(), &st) != 0) {
+        // First draft for this persona: evaluate the prefix alone and save
+        // it. Written under a unique name and renamed, so concurrent warm-ups
+        // for the same persona can't leave a torn file.
+        RequestTimings::Scope stage(timings, "prefix_warm");
+        const std::string tmp = cache_file + ".tmp" + std::to_string(random_seed());
+        std::vector<std::string> args = common_args;
+        args.insert(args.end(), {"-p", prefix, "-n", "1", "--prompt-cache", tmp});
+        ProcessResult warm = run_process(args);
+        if (warm.exit_status != 0 || rename(tmp.c_str(), cache_file.c_str()) != 0) {
+            unlink(tmp.c_str());
+            throw std::runtime_error("Failed to build prompt cache (status " + std::to_string(warm.exit_status) +
+                                     "): " + warm.stderr_text.substr(0, 500));
+        }
+        prune_prompt_cache(text_cli.cache_dir, text_cli.max_cache_files);
+    } else {
+        utime(cache_file.c_str(), nullptr);
+    }
+
+    std::vector<std::string> args = common_args;
+    args.insert(args.end(), {
+        "-p", prefix + tail,
+        "--prompt-cache", cache_file,
+        "--prompt-cache-ro",
+        "--temp", std::to_string(sampling.temperature),
+        "-n", std::to_string(sampling.n_predict),
+    });
+    return run_model_cli(args, timings);
+}
+
 std::string process_cv_with_vision(const std::vector<std::string>& image_paths, 
+                                   uint32_t seed,
+                                   RequestTimings& timings,
                                    const std::string& llama_cli_path, 
                                    const std::string& main_model_path, 
                                    const std::string& mmproj_path) {
     
     std::string prompt = create_cv_detection_prompt();
     
-    std::string image_args;
-    for (const auto& path : image_paths) {
-        image_args += " --image " + path;
-        std::cout << "  Passing image: " << path << std::endl;
-    }
-    
-    std::string cmd = llama_cli_path + " " +
-                      "-m " + main_model_path + " " + 
-                      "--mmproj " + mmproj_path + " " +
-                      image_args + " " +
-                      "-p \"" + prompt + "\" " + 
-                      "--n-gpu-layers 0 " + 
-                      "--temp 0.3 " +
-                      "-n 800 " +
-                      "2>&1";   
-        
     std::cout << "Executing vision model..." << std::endl;
-    std::cout << "Command: " << cmd << std::endl;
-    
-    try {
-        std::string output = exec_command(cmd);
-        std::cout << "Vision model raw output: " << output << std::endl;
-        return output;
-    } catch (const std::exception& e) {
-        throw std::runtime_error("Failed to execute vision model: " + std::string(e.what()));
+    return run_vision_model(image_paths, prompt, kCvSampling, seed, timings,
+                            llama_cli_path, main_model_path, mmproj_path);
+}
+
+// Drops the quoted history, signatures and disclaimers from a reply chain
+// so that only the new message (plus a short excerpt of its parent) is
+// prefilled
+std::string trim_thread_body(const std::string& body, const ThreadTrimConfig& config, RequestTimings& timings,
+                             std::pmr::memory_resource* scratch) {
+    RequestTimings::Scope stage(timings, "thread_trim");
+    TrimmedBody trimmed = trim_email_body(body, config, scratch);
+    if (trimmed.text.size() != body.size()) {
+        std::cout << "[TRIM] Body " << body.size() << " -> " << trimmed.text.size() << " bytes ("
+                  << trimmed.earlier_messages << " earlier messages, " << trimmed.dropped_lines
+                  << " lines dropped" << (trimmed.truncated ? ", excerpt truncated" : "") << ")" << std::endl;
     }
+    return std::move(trimmed.text);
 }
 
 // NEW: Process email with vision model for draft reply
@@ -418,75 +1244,39 @@ std::string process_draft_reply_with_vision(const std::vector<std::string>& imag
                                             const std::string& subject,
                                             const std::string& body,
                                             const std::string& instruction,
+                                            uint32_t seed,
+                                            RequestTimings& timings,
                                             const std::string& llama_cli_path, 
                                             const std::string& main_model_path, 
-                                            const std::string& mmproj_path) {
+                                            const std::string& mmproj_path,
+                                            const TextCliConfig& text_cli) {
     
-    std::string prompt = create_draft_reply_prompt(persona_string, subject, body, 
+    DraftPrompt prompt = create_draft_reply_prompt(persona_string, subject, body, 
                                                    instruction, !image_paths.empty());
     
-    std::string image_args;
-    for (const auto& path : image_paths) {
-        image_args += " --image " + path;
-        std::cout << "  Passing image: " << path << std::endl;
+    if (image_paths.empty() && !text_cli.cli_path.empty()) {
+        std::cout << "Executing text model for draft reply (persona prefix cached)..." << std::endl;
+        return run_text_model_with_prefix_cache(prompt, kDraftSampling, seed, timings,
+                                                text_cli, main_model_path);
     }
-    
-    std::string cmd = llama_cli_path + " " +
-                      "-m " + main_model_path + " " + 
-                      "--mmproj " + mmproj_path + " " +
-                      image_args + " " +
-                      "-p \"" + prompt + "\" " + 
-                      "--n-gpu-layers 0 " + 
-                      "--temp 0.7 " +
-                      "-n 1000 " +
-                      "2>&1";   
-        
     std::cout << "Executing vision model for draft reply..." << std::endl;
-    std::cout << "Command: " << cmd << std::endl;
-    
-    try {
-        std::string output = exec_command(cmd);
-        std::cout << "Vision model raw output: " << output << std::endl;
-        return output;
-    } catch (const std::exception& e) {
-        throw std::runtime_error("Failed to execute vision model: " + std::string(e.what()));
-    }
+    return run_vision_model(image_paths, prompt.prefix + prompt.tail, kDraftSampling, seed, timings,
+                            llama_cli_path, main_model_path, mmproj_path);
 }
 std::string process_classification_with_vision(const std::vector<std::string>& image_paths,
                                                const std::string& subject,
                                                const std::string& body,
+                                               uint32_t seed,
+                                               RequestTimings& timings,
                                                const std::string& llama_cli_path, 
                                                const std::string& main_model_path, 
                                                const std::string& mmproj_path) {
     
     std::string prompt = create_classification_prompt(subject, body, !image_paths.empty());
     
-    std::string image_args;
-    for (const auto& path : image_paths) {
-        image_args += " --image " + path;
-        std::cout << "  Passing image: " << path << std::endl;
-    }
-    
-    std::string cmd = llama_cli_path + " " +
-                      "-m " + main_model_path + " " + 
-                      "--mmproj " + mmproj_path + " " +
-                      image_args + " " +
-                      "-p \"" + prompt + "\" " + 
-                      "--n-gpu-layers 0 " + 
-                      "--temp 0.3 " +
-                      "-n 500 " +
-                      "2>&1";   
-        
     std::cout << "Executing vision model for classification..." << std::endl;
-    std::cout << "Command: " << cmd << std::endl;
-    
-    try {
-        std::string output = exec_command(cmd);
-        std::cout << "Vision model raw output: " << output << std::endl;
-        return output;
-    } catch (const std::exception& e) {
-        throw std::runtime_error("Failed to execute vision model: " + std::string(e.what()));
-    }
+    return run_vision_model(image_paths, prompt, kClassifySampling, seed, timings,
+                            llama_cli_path, main_model_path, mmproj_path);
 }
 int main(int argc, char** argv) {
     try {
@@ -494,6 +1284,33 @@ int main(int argc, char** argv) {
         std::string main_model_path = "/home/nor/.cache/llama.cpp/google_gemma-3-4b-it-qat-q4_0-gguf_gemma-3-4b-it-q4_0.gguf";
         std::string mmproj_path = "/home/nor/.cache/llama.cpp/google_gemma-3-4b-it-qat-q4_0-gguf_mmproj-model-f16-4B.gguf"; 
         std::string llama_cli_path = "../externals/llama.cpp/build/bin/llama-mtmd-cli";
+        // Page rendering is cheap and parallel; each decode runs a full CLI
+        // process using every core, so by default only one runs at a time.
+        size_t render_workers = std::max(1u, std::thread::hardware_concurrency() / 2);
+        size_t decode_workers = 1;
+        size_t http_threads = 8;
+        size_t http_max_threads = 256;
+        HttpTuning http_tuning;
+        int drain_timeout_sec = 30;
+        int shutdown_grace_sec = 0;
+        size_t classify_cache_size = 10000;
+        int classify_near_distance = 6;
+        std::string classify_cache_path;
+        size_t template_cache_size = 2000;
+        int template_distance = 6;
+        uint32_t template_min_observations = 3;
+        std::string template_cache_path;
+        http_tuning.default_body_limit = 10 * 1024 * 1024;
+        http_tuning.body_limits["/ai/inbox/detect-cv"] = 1024 * 1024;   // ids and file names only
+        std::string capture_path;
+        TextCliConfig text_cli;
+        ThreadTrimConfig thread_trim;
+        PageImageConfig page_image;
+        size_t page_cache_mb = 64;
+        std::string bench_pdf;
+        bool bench_extract = false;
+        Tracer::Config trace_config;
+        trace_config.service_name = "llama_api_server_cv_detection";
         
         // Parse command line arguments
         for (int i = 1; i < argc; i++) {
@@ -504,6 +1321,88 @@ int main(int argc, char** argv) {
                 mmproj_path = argv[++i];
             } else if (arg == "--cli-path" && i + 1 < argc) {
                 llama_cli_path = argv[++i];
+            } else if (arg == "--body-token-budget" && i + 1 < argc) {
+                thread_trim.token_budget = std::stoul(argv[++i]);
+            } else if (arg == "--parent-excerpt-tokens" && i + 1 < argc) {
+                thread_trim.parent_tokens = std::stoul(argv[++i]);
+            } else if (arg == "--keep-quoted-history") {
+                thread_trim.enabled = false;
+            } else if (arg == "--image-format" && i + 1 < argc) {
+                std::string format = argv[++i];
+                if (format != "ppm" && format != "png") {
+                    throw std::runtime_error("--image-format must be ppm or png");
+                }
+                page_image.preprocess = format == "ppm";
+            } else if (arg == "--image-size" && i + 1 < argc) {
+                page_image.size.width = page_image.size.height = std::stoi(argv[++i]);
+            } else if (arg == "--no-crop") {
+                page_image.size.crop = false;
+            } else if (arg == "--crop-threshold" && i + 1 < argc) {
+                page_image.size.crop_threshold = std::stoi(argv[++i]);
+            } else if (arg == "--crop-margin" && i + 1 < argc) {
+                page_image.size.crop_margin = std::stof(argv[++i]);
+            } else if (arg == "--render-mode" && i + 1 < argc) {
+                page_image.mode = parse_render_mode(argv[++i]);
+            } else if (arg == "--mono-threshold" && i + 1 < argc) {
+                page_image.mono_threshold = std::stoi(argv[++i]);
+            } else if (arg == "--page-cache-mb" && i + 1 < argc) {
+                page_cache_mb = std::stoul(argv[++i]);
+            } else if (arg == "--bench-preprocess" && i + 1 < argc) {
+                bench_pdf = argv[++i];
+            } else if (arg == "--bench-extract") {
+                bench_extract = true;
+            } else if (arg == "--text-cli-path" && i + 1 < argc) {
+                text_cli.cli_path = argv[++i];
+            } else if (arg == "--prompt-cache-dir" && i + 1 < argc) {
+                text_cli.cache_dir = argv[++i];
+            } else if (arg == "--prompt-cache-max" && i + 1 < argc) {
+                text_cli.max_cache_files = std::stoul(argv[++i]);
+            } else if (arg == "--text-user-turn" && i + 1 < argc) {
+                text_cli.user_turn = argv[++i];
+            } else if (arg == "--text-end-turn" && i + 1 < argc) {
+                text_cli.end_turn = argv[++i];
+            } else if (arg == "--text-model-turn" && i + 1 < argc) {
+                text_cli.model_turn = argv[++i];
+            } else if (arg == "--render-workers" && i + 1 < argc) {
+                render_workers = std::stoul(argv[++i]);
+            } else if (arg == "--decode-workers" && i + 1 < argc) {
+                decode_workers = std::stoul(argv[++i]);
+            } else if (arg == "--http-threads" && i + 1 < argc) {
+                http_threads = std::stoul(argv[++i]);
+            } else if (arg == "--http-max-threads" && i + 1 < argc) {
+                http_max_threads = std::stoul(argv[++i]);
+            } else if (arg == "--keep-alive-max" && i + 1 < argc) {
+                http_tuning.keep_alive_max_count = std::stoul(argv[++i]);
+            } else if (arg == "--keep-alive-timeout" && i + 1 < argc) {
+                http_tuning.keep_alive_timeout_sec = std::stol(argv[++i]);
+            } else if (arg == "--gzip-min-bytes" && i + 1 < argc) {
+                http_tuning.gzip_min_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--body-limit-kb" && i + 1 < argc) {
+                http_tuning.set_body_limit(argv[++i]);
+            } else if (arg == "--drain-timeout" && i + 1 < argc) {
+                drain_timeout_sec = std::stoi(argv[++i]);
+            } else if (arg == "--shutdown-grace" && i + 1 < argc) {
+                shutdown_grace_sec = std::stoi(argv[++i]);
+            } else if (arg == "--classify-cache-size" && i + 1 < argc) {
+                classify_cache_size = std::stoul(argv[++i]);
+            } else if (arg == "--classify-near-distance" && i + 1 < argc) {
+                classify_near_distance = std::stoi(argv[++i]);
+            } else if (arg == "--classify-cache-file" && i + 1 < argc) {
+                classify_cache_path = argv[++i];
+            } else if (arg == "--template-cache-size" && i + 1 < argc) {
+                template_cache_size = std::stoul(argv[++i]);
+            } else if (arg == "--template-distance" && i + 1 < argc) {
+                template_distance = std::stoi(argv[++i]);
+            } else if (arg == "--template-min-observations" && i + 1 < argc) {
+                template_min_observations = std::stoul(argv[++i]);
+            } else if (arg == "--template-cache-file" && i + 1 < argc) {
+                template_cache_path = argv[++i];
+            } else if (arg == "--capture-file" && i + 1 < argc) {
+                capture_path = argv[++i];
+            } else if (arg == "--otlp-endpoint" && i + 1 < argc) {
+                trace_config.endpoint = argv[++i];
+            } else if (arg == "--trace-sample-ratio" && i + 1 < argc) {
+                trace_config.sample_ratio = std::stod(argv[++i]);
             }
         }
         
@@ -518,6 +1417,23 @@ int main(int argc, char** argv) {
             return true;
         };
 
+        if (!bench_pdf.empty()) {
+            std::function<json(const std::string&)> extract;
+            if (bench_extract) {
+                if (!check_file(main_model_path, "main model") || !check_file(mmproj_path, "multimodal projection") ||
+                    !check_file(llama_cli_path, "llama-mtmd-cli")) {
+                    return 1;
+                }
+                extract = [&](const std::string& image_path) {
+                    RequestTimings timings;
+                    return parse_cv_metadata(process_cv_with_vision({image_path}, 42, timings, llama_cli_path,
+                                                                    main_model_path, mmproj_path));
+                };
+            }
+            bench_preprocess(bench_pdf, page_image, extract);
+            return 0;
+        }
+
         if (!check_file(main_model_path, "main model") || 
             !check_file(mmproj_path, "multimodal projection")) {
             return 1;
@@ -537,22 +1453,163 @@ int main(int argc, char** argv) {
         std::cout << "  Main Model Path: " << main_model_path << std::endl;
         std::cout << "  MMProj Path: " << mmproj_path << std::endl;
         std::cout << "  CLI Path: " << llama_cli_path << std::endl;
+        std::cout << "  Text CLI Path: " << (text_cli.cli_path.empty() ? "(disabled)" : text_cli.cli_path) << std::endl;
+        std::cout << "  Page Images: "
+                  << render_mode_name(page_image.mode) << ", "
+                  << (page_image.preprocess ? "pnm " + std::to_string(page_image.size.width) + "x" +
+                                                  std::to_string(page_image.size.height) + " (" +
+                                                  image_preprocess_detail::best_kernels().name + ")" +
+                                                  (page_image.size.crop ? ", cropped to content" : "")
+                                            : std::string("png")) << std::endl;
+        std::cout << "  Page Cache: " << page_cache_mb << " MiB" << std::endl;
+        std::cout << "  Render Workers: " << render_workers << std::endl;
+        std::cout << "  Decode Workers: " << decode_workers << std::endl;
+        std::cout << "  HTTP Threads: " << http_threads << "-" << http_max_threads << std::endl;
+        std::cout << "  Keep-Alive: " << http_tuning.keep_alive_max_count << " requests, "
+                  << http_tuning.keep_alive_timeout_sec << " s" << std::endl;
+        std::cout << "  Gzip Min Bytes: " << http_tuning.gzip_min_bytes << std::endl;
+        
+        std::cout << "  Drain Timeout: " << drain_timeout_sec << " s (grace " << shutdown_grace_sec << " s)" << std::endl;
+        
+        // Before any thread is started: they all inherit the blocked signals
+        ShutdownCoordinator shutdown;
+        shutdown.start(std::chrono::seconds(shutdown_grace_sec), std::chrono::seconds(drain_timeout_sec));
+        
+        RequestCaptureLog capture_log;
+        if (!capture_path.empty()) {
+            capture_log.open(capture_path);
+            std::cout << "  Capture File: " << capture_path << std::endl;
+        }
+        shutdown.on_flush("capture log", [&capture_log] { capture_log.close(); });
+        
+        Tracer tracer;
+        if (!trace_config.endpoint.empty()) {
+            std::cout << "  OTLP Endpoint: " << trace_config.endpoint
+                      << " (sample ratio " << trace_config.sample_ratio << ")" << std::endl;
+            tracer.start(trace_config);
+        }
+        shutdown.on_flush("trace export", [&tracer] { tracer.stop(); });
+        
+        ClassificationCache classify_cache(classify_cache_size, classify_near_distance);
+        std::cout << "  Classify Cache: " << classify_cache_size << " entries, near-duplicate distance "
+                  << classify_near_distance << std::endl;
+        if (classify_cache.enabled() && !classify_cache_path.empty()) {
+            classify_cache.load(classify_cache_path);
+            shutdown.on_flush("classification cache", [&classify_cache, classify_cache_path] {
+                classify_cache.save(classify_cache_path);
+            });
+        }
+        
+        TemplateCache templates(template_cache_size, template_distance, template_min_observations);
+        std::cout << "  Template Cache: " << template_cache_size << " templates, dHash distance "
+                  << template_distance << ", non-CV after " << template_min_observations << std::endl;
+        if (templates.enabled() && !template_cache_path.empty()) {
+            templates.load(template_cache_path);
+            shutdown.on_flush("template cache", [&templates, template_cache_path] {
+                templates.save(template_cache_path);
+            });
+        }
+        
+        PageRenderCache page_cache(page_cache_mb * 1024 * 1024);
+        page_image.cache = &page_cache;
+        
+        StagePool render_stage("render", render_workers);
+        StagePool decode_stage("decode", decode_workers);
         
         httplib::Server svr;
-        svr.set_payload_max_length(10 * 1024 * 1024);
+        apply_http_tuning(svr, http_tuning);
+        shutdown.on_stop([&svr] { svr.stop(); });
+        // Handlers block while their request waits for a decode worker, so the
+        // connection pool grows instead of letting /health queue behind them
+        std::atomic<ElasticTaskQueue*> http_queue{nullptr};
+        svr.new_task_queue = [&http_queue, http_threads, http_max_threads] {
+            auto* queue = new ElasticTaskQueue(http_threads, http_max_threads);
+            http_queue = queue;
+            return queue;
+        };
         
-        svr.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+        // Load balancers stop routing here once a drain has started
+        svr.Get("/health", [&shutdown](const httplib::Request&, httplib::Response& res) {
+            if (shutdown.draining()) {
+                res.status = 503;
+                res.set_content("{\"status\":\"draining\"}", "application/json");
+                return;
+            }
             res.set_content("{\"status\":\"ok\"}", "application/json");
         });
         
+        svr.Get("/metrics", [&http_queue, &render_stage, &decode_stage, &classify_cache, &page_cache, &templates](
+            const httplib::Request&, httplib::Response& res) {
+            json metrics = json::object();
+            auto cache_stats = classify_cache.snapshot();
+            metrics["classify_cache"] = {
+                {"entries", cache_stats.entries},
+                {"capacity", cache_stats.capacity},
+                {"hits_exact", cache_stats.hits_exact},
+                {"hits_near", cache_stats.hits_near},
+                {"misses", cache_stats.misses}
+            };
+            auto template_stats = templates.snapshot();
+            metrics["template_cache"] = {
+                {"templates", template_stats.templates},
+                {"capacity", template_stats.capacity},
+                {"matched", template_stats.matched},
+                {"created", template_stats.created},
+                {"rejected", template_stats.rejected}
+            };
+            auto page_stats = page_cache.snapshot();
+            auto arena_stats = RequestArena::stats();
+            metrics["request_arena"] = {
+                {"requests", arena_stats.requests},
+                {"spilled", arena_stats.spilled},
+                {"spilled_bytes", arena_stats.spilled_bytes}
+            };
+            metrics["page_cache"] = {
+                {"entries", page_stats.entries},
+                {"bytes", page_stats.bytes},
+                {"capacity_bytes", page_stats.capacity_bytes},
+                {"hits", page_stats.hits},
+                {"misses", page_stats.misses}
+            };
+            for (const StagePool* stage : {&render_stage, &decode_stage}) {
+                metrics["stages"][stage->stage_name()] = {
+                    {"workers", stage->size()},
+                    {"queued", stage->queued()}
+                };
+            }
+            if (ElasticTaskQueue* queue = http_queue.load()) {
+                auto stats = queue->stats();
+                metrics["http"] = {
+                    {"threads", stats.threads},
+                    {"threads_idle", stats.idle},
+                    {"threads_peak", stats.peak_threads},
+                    {"threads_min", stats.min_threads},
+                    {"threads_max", stats.max_threads},
+                    {"connections_queued", stats.queued},
+                    {"connections_total", stats.connections}
+                };
+            }
+            res.set_content(metrics.dump(), "application/json");
+        });
+        
         // CV Detection Endpoint
-        svr.Post("/ai/inbox/detect-cv", [main_model_path, mmproj_path, &llama_cli_path](
+        svr.Post("/ai/inbox/detect-cv", [main_model_path, mmproj_path, &llama_cli_path, &page_image, &render_stage, &decode_stage, &capture_log, &tracer, &templates](
             const httplib::Request& req, httplib::Response& res) {
             std::vector<std::string> image_paths; 
             bool cv_detected = false;
+            RequestTimings timings;
+            RequestArena arena;     // scratch for output parsing
+            RequestTimings::HeaderScope<httplib::Response> timing_header(timings, res);
+            CaptureScope capture(capture_log, timings, res.status, req.path, req.body);
+            TraceScope trace(tracer, timings, res.status, req.method, req.path,
+                             req.get_header_value("traceparent"));
             
             try {
-                json input_json = json::parse(req.body);
+                json input_json;
+                {
+                    RequestTimings::Scope stage(timings, "parse");
+                    input_json = json::parse(req.body);
+                }
                 
                 if (!input_json.contains("attachments")) {
                     res.status = 400;
@@ -565,38 +1622,44 @@ int main(int argc, char** argv) {
                 json attachments = input_json["attachments"];
                 json metadata;
 
+                std::vector<std::string> filenames;
                 for (const auto& attachment : attachments) {
                     std::string filename = attachment.get<std::string>();
                     std::cout << "Checking attachment: " << filename << std::endl;
-
-                    if (is_pdf_file(filename)) {
-                        try {
-                            std::string pdf_path = "../uploads/" + filename;
-                            std::string temp_dir = "../uploads/temp";
-                            
-                            struct stat st = {0};
-                            if (stat(temp_dir.c_str(), &st) == -1) {
-                                if (mkdir(temp_dir.c_str(), 0755) != 0) {
-                                    throw std::runtime_error("Failed to create temp directory");
-                                }
-                            }
-                            
-                            std::string current_image_path = pdf_to_image(pdf_path, temp_dir); 
-                            image_paths.push_back(current_image_path);
-                            
-                        } catch (const std::exception& e) {
-                            std::cerr << "Error converting PDF " << filename << ": " 
-                                     << e.what() << std::endl;
-                            continue;
-                        }
+                    filenames.push_back(filename);
+                }
+                if (capture.active()) capture.record.attachments = hash_attachments(filenames);
+                
+                // Attachments from templates that have only ever been
+                // non-CVs don't go to the model
+                std::vector<uint64_t> template_ids = assign_templates(filenames, render_stage, templates, timings);
+                std::vector<std::string> candidates;
+                std::vector<uint64_t> candidate_templates;
+                for (size_t i = 0; i < filenames.size(); ++i) {
+                    if (template_ids[i] != 0 && templates.cv_verdict(template_ids[i]) == TemplateCache::Verdict::NotCv) {
+                        std::cout << "[TEMPLATE] Skipping " << filenames[i] << ": known non-CV template" << std::endl;
+                        continue;
                     }
+                    candidates.push_back(filenames[i]);
+                    if (is_pdf_file(filenames[i])) candidate_templates.push_back(template_ids[i]);
                 }
+                image_paths = render_pdf_attachments(candidates, render_stage, page_image, timings);
                 
                 if (!image_paths.empty()) {
                     cv_detected = true;
-                    std::string model_output = process_cv_with_vision(image_paths, llama_cli_path, 
-                                                                      main_model_path, mmproj_path);
-                    metadata = parse_cv_metadata(model_output);
+                    const uint32_t seed = request_seed(input_json);
+                    capture_sampling(capture, kCvSampling, seed);
+                    std::string model_output = run_on_decode_stage(decode_stage, timings, [&] {
+                        return process_cv_with_vision(image_paths, seed, timings, llama_cli_path,
+                                                      main_model_path, mmproj_path);
+                    });
+                    RequestTimings::Scope stage(timings, "extract");
+                    metadata = parse_cv_metadata(model_output, arena.resource());
+                    // The outcome only says something about a template when
+                    // the model saw that one document alone
+                    if (image_paths.size() == 1 && candidate_templates.size() == 1 && candidate_templates[0] != 0) {
+                        templates.record_cv(candidate_templates[0], metadata_looks_like_cv(metadata));
+                    }
                 } else {
                     metadata = json::object();
                 }
@@ -609,7 +1672,7 @@ int main(int argc, char** argv) {
                 };
                 output_json["metadata"] = metadata;
                 
-                res.set_content(output_json.dump(2), "application/json");
+                res.set_content(output_json.dump(), "application/json");
                 
             } catch (const std::exception& e) {
                 cleanup_temp_images(image_paths);
@@ -618,12 +1681,21 @@ int main(int argc, char** argv) {
                                "application/json");
             }
         });
-    svr.Post("/ai/inbox/draft-reply", [main_model_path, mmproj_path, &llama_cli_path](
+    svr.Post("/ai/inbox/draft-reply", [main_model_path, mmproj_path, &llama_cli_path, &text_cli, &thread_trim, &page_image, &render_stage, &decode_stage, &capture_log, &tracer](
     const httplib::Request& req, httplib::Response& res) {
     std::vector<std::string> image_paths;
+    RequestTimings timings;
+    RequestArena arena;     // scratch for trimming and output parsing
+    RequestTimings::HeaderScope<httplib::Response> timing_header(timings, res);
+    CaptureScope capture(capture_log, timings, res.status, req.path, req.body);
+    TraceScope trace(tracer, timings, res.status, req.method, req.path, req.get_header_value("traceparent"));
     
     try {
-        json input_json = json::parse(req.body);
+        json input_json;
+        {
+            RequestTimings::Scope stage(timings, "parse");
+            input_json = json::parse(req.body);
+        }
         
         // Validate required fields (instruction is now optional)
         if (!input_json.contains("email_id") || !input_json.contains("subject") || 
@@ -636,7 +1708,7 @@ int main(int argc, char** argv) {
         
         std::string email_id = input_json["email_id"];
         std::string subject = input_json["subject"];
-        std::string body = input_json["body"];
+        std::string body = trim_thread_body(input_json["body"], thread_trim, timings, arena.resource());
         std::string persona_string = input_json["persona_string"];
         
         // Instruction is now optional - default to empty string if not provided
@@ -646,43 +1718,33 @@ int main(int argc, char** argv) {
         if (input_json.contains("attachments") && input_json["attachments"].is_array()) {
             json attachments = input_json["attachments"];
             
+            std::vector<std::string> filenames;
             for (const auto& attachment : attachments) {
                 if (!attachment.contains("filename")) continue;
                 
                 std::string filename = attachment["filename"].get<std::string>();
                 std::cout << "Processing attachment: " << filename << std::endl;
-
-                if (is_pdf_file(filename)) {
-                    try {
-                        std::string pdf_path = "../uploads/" + filename;
-                        std::string temp_dir = "../uploads/temp";
-                        
-                        struct stat st = {0};
-                        if (stat(temp_dir.c_str(), &st) == -1) {
-                            if (mkdir(temp_dir.c_str(), 0755) != 0) {
-                                throw std::runtime_error("Failed to create temp directory");
-                            }
-                        }
-                        
-                        std::string current_image_path = pdf_to_image(pdf_path, temp_dir);
-                        image_paths.push_back(current_image_path);
-                        
-                    } catch (const std::exception& e) {
-                        std::cerr << "Error converting PDF " << filename << ": " 
-                                 << e.what() << std::endl;
-                        continue;
-                    }
-                }
+                filenames.push_back(filename);
             }
+            if (capture.active()) capture.record.attachments = hash_attachments(filenames);
+            image_paths = render_pdf_attachments(filenames, render_stage, page_image, timings);
         }
         
         // Generate draft reply
-        std::string model_output = process_draft_reply_with_vision(
-            image_paths, persona_string, subject, body, instruction,
-            llama_cli_path, main_model_path, mmproj_path
-        );
+        const uint32_t seed = request_seed(input_json);
+        capture_sampling(capture, kDraftSampling, seed);
+        std::string model_output = run_on_decode_stage(decode_stage, timings, [&] {
+            return process_draft_reply_with_vision(
+                image_paths, persona_string, subject, body, instruction, seed, timings,
+                llama_cli_path, main_model_path, mmproj_path, text_cli
+            );
+        });
         
-        json reply_data = parse_draft_reply(model_output);
+        json reply_data;
+        {
+            RequestTimings::Scope stage(timings, "extract");
+            reply_data = parse_draft_reply(model_output, arena.resource());
+        }
         
         cleanup_temp_images(image_paths);
         
@@ -692,7 +1754,7 @@ int main(int argc, char** argv) {
             {"draft_reply", reply_data["draft_reply"]}
         };
         
-        res.set_content(output_json.dump(2), "application/json");
+        res.set_content(output_json.dump(), "application/json");
         
     } catch (const std::exception& e) {
         cleanup_temp_images(image_paths);
@@ -701,12 +1763,22 @@ int main(int argc, char** argv) {
                        "application/json");
     }
 });
-        svr.Post("/ai/inbox/classify", [main_model_path, mmproj_path, &llama_cli_path](
+        svr.Post("/ai/inbox/classify", [main_model_path, mmproj_path, &llama_cli_path, &thread_trim, &page_image, &render_stage, &decode_stage, &capture_log, &tracer, &classify_cache, &templates](
             const httplib::Request& req, httplib::Response& res) {
             std::vector<std::string> image_paths;
+            RequestTimings timings;
+            RequestArena arena;     // scratch for trimming, cache keys and output parsing
+            RequestTimings::HeaderScope<httplib::Response> timing_header(timings, res);
+            CaptureScope capture(capture_log, timings, res.status, req.path, req.body);
+            TraceScope trace(tracer, timings, res.status, req.method, req.path,
+                             req.get_header_value("traceparent"));
             
             try {
-                json input_json = json::parse(req.body);
+                json input_json;
+                {
+                    RequestTimings::Scope stage(timings, "parse");
+                    input_json = json::parse(req.body);
+                }
                 
                 // Validate required fields
                 if (!input_json.contains("email_id") || !input_json.contains("subject") || 
@@ -719,9 +1791,11 @@ int main(int argc, char** argv) {
                 
                 std::string email_id = input_json["email_id"];
                 std::string subject = input_json["subject"];
-                std::string body = input_json["body"];
+                // Replies in the same thread then also share a cache key
+                std::string body = trim_thread_body(input_json["body"], thread_trim, timings, arena.resource());
                 
                 // Process attachments if present (optional)
+                std::vector<std::string> filenames;
                 if (input_json.contains("attachments") && input_json["attachments"].is_array()) {
                     json attachments = input_json["attachments"];
                     
@@ -730,40 +1804,61 @@ int main(int argc, char** argv) {
                         
                         std::string filename = attachment["filename"].get<std::string>();
                         std::cout << "Processing attachment for classification: " << filename << std::endl;
-
-                        if (is_pdf_file(filename)) {
-                            try {
-                                std::string pdf_path = "../uploads/" + filename;
-                                std::string temp_dir = "../uploads/temp";
-                                
-                                struct stat st = {0};
-                                if (stat(temp_dir.c_str(), &st) == -1) {
-                                    if (mkdir(temp_dir.c_str(), 0755) != 0) {
-                                        throw std::runtime_error("Failed to create temp directory");
-                                    }
-                                }
-                                
-                                std::string current_image_path = pdf_to_image(pdf_path, temp_dir);
-                                image_paths.push_back(current_image_path);
-                                
-                            } catch (const std::exception& e) {
-                                std::cerr << "Error converting PDF " << filename << ": " 
-                                         << e.what() << std::endl;
-                                continue;
-                            }
-                        }
+                        filenames.push_back(filename);
                     }
                 }
                 
-                // Classify email
-                std::string model_output = process_classification_with_vision(
-                    image_paths, subject, body,
-                    llama_cli_path, main_model_path, mmproj_path
-                );
-                
-                json classification_data = parse_classification(model_output);
+                // Bulk mail repeats: reuse the result of an identical or
+                // near-identical email with the same attachments. PDFs count
+                // as the same when they come from the same template, so one
+                // vendor's invoices share a key whatever the amounts are.
+                ClassificationKey cache_key;
+                if (classify_cache.enabled() || capture.active()) {
+                    std::vector<uint64_t> template_ids;
+                    if (classify_cache.enabled()) {
+                        template_ids = assign_templates(filenames, render_stage, templates, timings);
+                    }
+                    RequestTimings::Scope stage(timings, "cache_lookup");
+                    std::vector<CapturedAttachment> hashed = hash_attachments(filenames);
+                    std::vector<uint64_t> attachment_hashes;
+                    for (size_t i = 0; i < hashed.size(); ++i) {
+                        const bool templated = i < template_ids.size() && template_ids[i] != 0;
+                        attachment_hashes.push_back(templated ? template_ids[i] : hashed[i].hash);
+                    }
+                    if (capture.active()) capture.record.attachments = std::move(hashed);
+                    cache_key = classification_key(subject, body, attachment_hashes, arena.resource());
+                }
+                std::string cached;
+                ClassificationCache::Hit hit = classify_cache.lookup(cache_key, cached);
+                json classification_data;
                 
-                cleanup_temp_images(image_paths);
+                if (hit != ClassificationCache::Hit::None) {
+                    res.set_header("X-Cache", hit == ClassificationCache::Hit::Exact ? "hit" : "near-hit");
+                    classification_data = json::parse(cached);
+                } else {
+                    if (classify_cache.enabled()) res.set_header("X-Cache", "miss");
+                    image_paths = render_pdf_attachments(filenames, render_stage, page_image, timings);
+                    
+                    // Classify email
+                    const uint32_t seed = request_seed(input_json);
+                    capture_sampling(capture, kClassifySampling, seed);
+                    std::string model_output = run_on_decode_stage(decode_stage, timings, [&] {
+                        return process_classification_with_vision(
+                            image_paths, subject, body, seed, timings,
+                            llama_cli_path, main_model_path, mmproj_path
+                        );
+                    });
+                    
+                    bool parsed_ok = false;
+                    {
+                        RequestTimings::Scope stage(timings, "extract");
+                        classification_data = parse_classification(model_output, &parsed_ok, arena.resource());
+                    }
+                    // Don't pin the fallback answer for an unparseable output
+                    if (parsed_ok) classify_cache.insert(cache_key, classification_data.dump());
+                    
+                    cleanup_temp_images(image_paths);
+                }
                 
                 json output_json = {
                     {"email_id", email_id},
@@ -771,7 +1866,7 @@ int main(int argc, char** argv) {
                     {"confidence", classification_data["confidence"]}
                 };
                 
-                res.set_content(output_json.dump(2), "application/json");
+                res.set_content(output_json.dump(), "application/json");
                 
             } catch (const std::exception& e) {
                 cleanup_temp_images(image_paths);
@@ -783,10 +1878,14 @@ int main(int argc, char** argv) {
         std::cout << "\nCV Detection & Draft Reply Server starting on port 8080..." << std::endl;
         std::cout << "Endpoints:" << std::endl;
         std::cout << "  - GET  /health" << std::endl;
+        std::cout << "  - GET  /metrics" << std::endl;
         std::cout << "  - POST /ai/inbox/detect-cv" << std::endl;
         std::cout << "  - POST /ai/inbox/draft-reply" << std::endl;
         std::cout << "  - POST /ai/inbox/classify" << std::endl;
-        svr.listen("0.0.0.0", 8080);
+        // Returns after a shutdown signal, once in-flight requests are done
+        if (!shutdown.draining()) svr.listen("0.0.0.0", 8080);
+        shutdown.finish();
+        std::cout << "Drained, exiting" << std::endl;
         
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
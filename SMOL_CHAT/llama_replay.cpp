@@ -0,0 +1,240 @@
+// llama_replay.cpp
+// Re-runs traffic recorded with --capture-file against a running server, at
+// the original arrival times or a scaled rate, and compares latencies with
+// the ones captured. Each request is sent with its captured seed so the
+// server samples the same tokens as the original run.
+
+#include "httplib.h"
+#include <nlohmann/json.hpp>
+#include "request_capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+struct ReplayResult {
+    std::string endpoint;
+    int captured_status = 0;
+    int status = 0;               // 0 = no response
+    double captured_ms = 0.0;
+    double latency_ms = 0.0;
+    double send_lag_ms = 0.0;     // how late the request left vs its schedule
+};
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t idx = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5));
+    return values[idx];
+}
+
+double captured_total_ms(const CaptureRecord& record) {
+    for (const auto& stage : record.stages) {
+        if (stage.name == "total") return stage.ms;
+    }
+    return 0.0;
+}
+
+void print_record(const CaptureRecord& r) {
+    std::cout << std::fixed << std::setprecision(3)
+              << "t=" << r.arrival_us / 1e6 << "s " << r.endpoint
+              << " status=" << r.status << " seed=" << r.seed
+              << " temp=" << r.temperature << " max_tokens=" << r.max_tokens
+              << " payload=" << r.payload.size() << "B" << std::endl;
+    for (const auto& a : r.attachments) {
+        std::cout << "    attachment " << a.name << " hash=" << std::hex << a.hash << std::dec << std::endl;
+    }
+    for (const auto& s : r.stages) {
+        std::cout << "    " << std::left << std::setw(14) << s.name << std::right
+                  << std::setw(10) << s.ms << " ms " << s.detail << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <capture-file> [--target URL] [--rate-scale X] [--max-rate]\n"
+                  << "       [--concurrency N] [--limit N] [--uploads-dir DIR] [--dump]" << std::endl;
+        return 1;
+    }
+
+    std::string capture_path = argv[1];
+    std::string target = "http://localhost:8080";
+    double rate_scale = 1.0;      // 2.0 = arrivals twice as fast as captured
+    bool max_rate = false;        // ignore arrival times, send as fast as workers allow
+    size_t concurrency = 32;
+    size_t limit = 0;
+    std::string uploads_dir;
+    bool dump_only = false;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--target" && i + 1 < argc) {
+            target = argv[++i];
+        } else if (arg == "--rate-scale" && i + 1 < argc) {
+            rate_scale = std::stod(argv[++i]);
+        } else if (arg == "--max-rate") {
+            max_rate = true;
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--limit" && i + 1 < argc) {
+            limit = std::stoul(argv[++i]);
+        } else if (arg == "--uploads-dir" && i + 1 < argc) {
+            uploads_dir = argv[++i];
+        } else if (arg == "--dump") {
+            dump_only = true;
+        }
+    }
+    if (rate_scale <= 0.0) {
+        std::cerr << "ERROR: --rate-scale must be positive" << std::endl;
+        return 1;
+    }
+
+    std::vector<CaptureRecord> records;
+    try {
+        CaptureReader reader(capture_path);
+        CaptureRecord record;
+        while ((limit == 0 || records.size() < limit) && reader.next(record)) {
+            records.push_back(std::move(record));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Loaded " << records.size() << " captured requests from " << capture_path << std::endl;
+
+    if (dump_only) {
+        for (const auto& r : records) print_record(r);
+        return 0;
+    }
+
+    // Replays are only comparable if the attachments are the same files
+    if (!uploads_dir.empty()) {
+        size_t mismatches = 0;
+        for (const auto& r : records) {
+            for (const auto& a : r.attachments) {
+                if (hash_file(uploads_dir + "/" + a.name) != a.hash) {
+                    std::cerr << "WARNING: attachment " << a.name << " differs from the captured file" << std::endl;
+                    ++mismatches;
+                }
+            }
+        }
+        std::cout << "Attachment check: " << mismatches << " mismatch(es)" << std::endl;
+    }
+
+    std::vector<ReplayResult> results(records.size());
+    std::deque<size_t> ready;
+    std::mutex ready_mutex;
+    std::condition_variable ready_cv;
+    bool dispatch_done = false;
+
+    const auto replay_start = std::chrono::steady_clock::now();
+    auto scheduled_at = [&](size_t i) {
+        auto offset = std::chrono::microseconds((int64_t)(records[i].arrival_us / rate_scale));
+        return replay_start + offset;
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < concurrency; ++w) {
+        workers.emplace_back([&] {
+            httplib::Client cli(target);
+            cli.set_connection_timeout(5);
+            cli.set_read_timeout(600);
+            for (;;) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(ready_mutex);
+                    ready_cv.wait(lock, [&] { return dispatch_done || !ready.empty(); });
+                    if (ready.empty()) return;
+                    i = ready.front();
+                    ready.pop_front();
+                }
+
+                const CaptureRecord& r = records[i];
+                ReplayResult& out = results[i];
+                out.endpoint = r.endpoint;
+                out.captured_status = r.status;
+                out.captured_ms = captured_total_ms(r);
+
+                // Pin the seed so sampling matches the captured run
+                std::string body = r.payload;
+                try {
+                    json payload = json::parse(r.payload);
+                    payload["seed"] = r.seed;
+                    body = payload.dump();
+                } catch (const json::parse_error&) {
+                    // Replay malformed payloads as-is; they were captured that way
+                }
+
+                auto t0 = std::chrono::steady_clock::now();
+                if (!max_rate) {
+                    out.send_lag_ms = std::chrono::duration<double, std::milli>(t0 - scheduled_at(i)).count();
+                }
+                auto res = cli.Post(r.endpoint, body, "application/json");
+                out.latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                out.status = res ? res->status : 0;
+            }
+        });
+    }
+
+    // Release each request at its (scaled) captured arrival time
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (!max_rate) std::this_thread::sleep_until(scheduled_at(i));
+        {
+            std::lock_guard<std::mutex> lock(ready_mutex);
+            ready.push_back(i);
+        }
+        ready_cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        dispatch_done = true;
+    }
+    ready_cv.notify_all();
+    for (auto& w : workers) w.join();
+
+    const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    // Summary per endpoint: replayed vs captured latency
+    std::map<std::string, std::vector<const ReplayResult*>> by_endpoint;
+    for (const auto& r : results) by_endpoint[r.endpoint].push_back(&r);
+
+    std::cout << "\nReplayed " << results.size() << " requests in " << std::fixed << std::setprecision(2)
+              << wall_s << " s against " << target << std::endl;
+    for (const auto& [endpoint, list] : by_endpoint) {
+        std::vector<double> replayed, captured, lag;
+        size_t errors = 0, status_changes = 0;
+        for (const auto* r : list) {
+            replayed.push_back(r->latency_ms);
+            captured.push_back(r->captured_ms);
+            lag.push_back(r->send_lag_ms);
+            if (r->status == 0 || r->status >= 500) ++errors;
+            if (r->status != r->captured_status) ++status_changes;
+        }
+        std::cout << "\n" << endpoint << ": " << list.size() << " requests, " << errors << " errors, "
+                  << status_changes << " status changes" << std::endl;
+        std::cout << "  latency ms     p50        p95        p99" << std::endl;
+        std::cout << "  replayed  " << std::setw(10) << percentile(replayed, 0.50)
+                  << " " << std::setw(10) << percentile(replayed, 0.95)
+                  << " " << std::setw(10) << percentile(replayed, 0.99) << std::endl;
+        std::cout << "  captured  " << std::setw(10) << percentile(captured, 0.50)
+                  << " " << std::setw(10) << percentile(captured, 0.95)
+                  << " " << std::setw(10) << percentile(captured, 0.99) << std::endl;
+        if (!max_rate) {
+            std::cout << "  send lag  " << std::setw(10) << percentile(lag, 0.50)
+                      << " " << std::setw(10) << percentile(lag, 0.95)
+                      << " " << std::setw(10) << percentile(lag, 0.99) << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+// page_render_cache.h
+// Rendered PDF pages, kept so a document that arrives again (forwards,
+// re-classification, the same CV sent to several addresses) skips poppler
+// entirely. Entries are PageBitmaps in their packed form, so the cache
+// holds about four times as many gray pages and thirty-two times as many
+// mono pages as full-color ones in the same memory. Keys are the file's
+// content hash combined with the render mode.
+
+#pragma once
+
+#include "image_preprocess.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// LRU bounded by total bitmap bytes. Thread-safe. Capacity 0 disables it.
+class PageRenderCache {
+public:
+    struct Stats {
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t capacity_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    explicit PageRenderCache(size_t capacity_bytes) : capacity(capacity_bytes) {}
+
+    bool enabled() const { return capacity > 0; }
+
+    std::shared_ptr<const PageBitmap> lookup(uint64_t key) {
+        if (!enabled()) return nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_key.find(key);
+        if (it == by_key.end()) {
+            ++stats.misses;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        ++stats.hits;
+        return it->second->page;
+    }
+
+    void insert(uint64_t key, std::shared_ptr<const PageBitmap> page) {
+        if (!enabled() || page->bytes() > capacity) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_key.find(key);
+        if (it != by_key.end()) {
+            stats.bytes -= it->second->page->bytes();
+            lru.erase(it->second);
+            by_key.erase(it);
+        }
+        stats.bytes += page->bytes();
+        lru.push_front({key, std::move(page)});
+        by_key[key] = lru.begin();
+        while (stats.bytes > capacity) {
+            stats.bytes -= lru.back().page->bytes();
+            by_key.erase(lru.back().key);
+            lru.pop_back();
+        }
+    }
+
+    Stats snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s = stats;
+        s.entries = lru.size();
+        s.capacity_bytes = capacity;
+        return s;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<const PageBitmap> page;
+    };
+
+    const size_t capacity;
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> by_key;
+    mutable std::mutex mutex;
+    Stats stats;
+};
@@ -0,0 +1,126 @@
+// request_arena.h
+// Per-request scratch memory. A RequestArena is a monotonic arena
+// (std::pmr::monotonic_buffer_resource) over a buffer owned by the handler
+// thread, so the throwaway strings and vectors a request builds (line
+// splits, normalised text, JSON substrings) come from a pointer bump in
+// memory that thread already owns, with no malloc lock, and are all
+// released at once when the request ends.
+//
+// The thread's buffer starts at 64 KiB. A request that outgrows it spills
+// to the heap, and the buffer is then resized to that request's
+// high-water mark (up to 4 MiB), so a thread settles at the size its
+// requests need.
+//
+// Only scratch data goes in the arena: anything that outlives the request,
+// or crosses to another thread, such as the response body, JSON values or
+// the tokens handed to the scheduler, stays on the default allocator.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+
+class RequestArena {
+public:
+    static constexpr size_t kInitialBytes = 64 * 1024;
+    static constexpr size_t kMaxBytes = 4 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t spilled = 0;           // requests that outgrew their thread's buffer
+        uint64_t spilled_bytes = 0;
+    };
+
+    RequestArena() {
+        ThreadBuffer& tb = thread_buffer();
+        if (tb.in_use) {
+            // A nested arena on the same thread (not expected, but harmless)
+            // works from the heap
+            arena.emplace(&upstream);
+            return;
+        }
+        if (!tb.data) {
+            tb.size = kInitialBytes;
+            tb.data.reset(new std::byte[tb.size]);
+        }
+        tb.in_use = true;
+        owns_buffer = true;
+        arena.emplace(tb.data.get(), tb.size, &upstream);
+    }
+
+    ~RequestArena() {
+        arena.reset();
+        counters().requests.fetch_add(1, std::memory_order_relaxed);
+        if (upstream.bytes > 0) {
+            counters().spilled.fetch_add(1, std::memory_order_relaxed);
+            counters().spilled_bytes.fetch_add(upstream.bytes, std::memory_order_relaxed);
+        }
+        if (!owns_buffer) return;
+        ThreadBuffer& tb = thread_buffer();
+        if (upstream.bytes > 0 && tb.size < kMaxBytes) {
+            tb.size = std::min(kMaxBytes, tb.size + upstream.bytes);
+            tb.data.reset(new std::byte[tb.size]);
+        }
+        tb.in_use = false;
+    }
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &*arena; }
+
+    static Stats stats() {
+        Stats s;
+        s.requests = counters().requests.load(std::memory_order_relaxed);
+        s.spilled = counters().spilled.load(std::memory_order_relaxed);
+        s.spilled_bytes = counters().spilled_bytes.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    struct ThreadBuffer {
+        std::unique_ptr<std::byte[]> data;
+        size_t size = 0;
+        bool in_use = false;
+    };
+
+    struct Counters {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> spilled{0};
+        std::atomic<uint64_t> spilled_bytes{0};
+    };
+
+    // Heap fallback that remembers how much the request needed beyond the
+    // thread's buffer
+    struct CountingUpstream : std::pmr::memory_resource {
+        size_t bytes = 0;
+
+        void* do_allocate(size_t n, size_t align) override {
+            bytes += n;
+            return std::pmr::new_delete_resource()->allocate(n, align);
+        }
+        void do_deallocate(void* p, size_t n, size_t align) override {
+            std::pmr::new_delete_resource()->deallocate(p, n, align);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+
+    static ThreadBuffer& thread_buffer() {
+        thread_local ThreadBuffer tb;
+        return tb;
+    }
+
+    static Counters& counters() {
+        static Counters c;
+        return c;
+    }
+
+    bool owns_buffer = false;
+    CountingUpstream upstream;
+    std::optional<std::pmr::monotonic_buffer_resource> arena;
+};
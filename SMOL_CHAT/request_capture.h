@@ -0,0 +1,329 @@
+// request_capture.h
+// Opt-in request capture for performance debugging. Each served request is
+// appended to a compact binary log (payload, attachment hashes, seed,
+// sampling parameters, stage timings) that llama_replay can re-run later.
+//
+// File layout: "LLRC" magic, u8 version, then one record per request:
+//   varint record_size, record bytes
+// Integers are LEB128 varints, floats are little-endian IEEE-754 f32 and
+// strings are varint length + bytes.
+
+#pragma once
+
+#include "request_timing.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct CapturedAttachment {
+    std::string name;
+    uint64_t hash = 0;    // FNV-1a 64 of the file contents, 0 if unreadable
+};
+
+struct CaptureRecord {
+    uint64_t arrival_us = 0;      // microseconds since capture started
+    std::string endpoint;
+    std::string payload;
+    uint32_t seed = 0;
+    float temperature = 0.0f;
+    float top_p = 0.0f;
+    int32_t top_k = 0;
+    int32_t max_tokens = 0;
+    int32_t status = 0;
+    std::vector<CapturedAttachment> attachments;
+    std::vector<StageTiming> stages;
+};
+
+// Seed for a request that didn't specify one. Sampling always runs with an
+// explicit seed so a captured request can be replayed with identical output.
+inline uint32_t random_seed() {
+    static std::mutex seed_mutex;
+    static std::mt19937 gen{std::random_device{}()};
+    std::lock_guard<std::mutex> lock(seed_mutex);
+    return gen();
+}
+
+inline uint64_t fnv1a64(const void* data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline uint64_t hash_file(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return 0;
+    std::vector<char> buf(64 * 1024);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), f)) > 0) {
+        hash = fnv1a64(buf.data(), n, hash);
+    }
+    fclose(f);
+    return hash;
+}
+
+namespace capture_detail {
+
+constexpr char kMagic[4] = {'L', 'L', 'R', 'C'};
+constexpr uint8_t kVersion = 1;
+
+inline void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+inline void put_f32(std::string& out, float f) {
+    char b[4];
+    std::memcpy(b, &f, 4);
+    out.append(b, 4);
+}
+
+inline void put_str(std::string& out, const std::string& s) {
+    put_varint(out, s.size());
+    out.append(s);
+}
+
+// Signed values are zigzag-encoded so small negatives stay short
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+class Cursor {
+public:
+    Cursor(const char* data, size_t len) : p(data), end(data + len) {}
+
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            need(1);
+            uint8_t b = static_cast<uint8_t>(*p++);
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw std::runtime_error("Malformed varint in capture log");
+    }
+
+    float f32() {
+        need(4);
+        float f;
+        std::memcpy(&f, p, 4);
+        p += 4;
+        return f;
+    }
+
+    std::string str() {
+        size_t n = varint();
+        need(n);
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+
+private:
+    void need(size_t n) {
+        if (static_cast<size_t>(end - p) < n) throw std::runtime_error("Truncated capture record");
+    }
+
+    const char* p;
+    const char* end;
+};
+
+}  // namespace capture_detail
+
+inline std::string encode_capture_record(const CaptureRecord& r) {
+    using namespace capture_detail;
+    std::string out;
+    out.reserve(64 + r.endpoint.size() + r.payload.size());
+    put_varint(out, r.arrival_us);
+    put_str(out, r.endpoint);
+    put_str(out, r.payload);
+    put_varint(out, r.seed);
+    put_f32(out, r.temperature);
+    put_f32(out, r.top_p);
+    put_varint(out, zigzag(r.top_k));
+    put_varint(out, zigzag(r.max_tokens));
+    put_varint(out, zigzag(r.status));
+    put_varint(out, r.attachments.size());
+    for (const auto& a : r.attachments) {
+        put_str(out, a.name);
+        put_varint(out, a.hash);
+    }
+    put_varint(out, r.stages.size());
+    for (const auto& s : r.stages) {
+        put_str(out, s.name);
+        put_f32(out, static_cast<float>(s.ms));
+        put_str(out, s.detail);
+    }
+    return out;
+}
+
+inline CaptureRecord decode_capture_record(const std::string& bytes) {
+    using namespace capture_detail;
+    Cursor c(bytes.data(), bytes.size());
+    CaptureRecord r;
+    r.arrival_us = c.varint();
+    r.endpoint = c.str();
+    r.payload = c.str();
+    r.seed = static_cast<uint32_t>(c.varint());
+    r.temperature = c.f32();
+    r.top_p = c.f32();
+    r.top_k = static_cast<int32_t>(unzigzag(c.varint()));
+    r.max_tokens = static_cast<int32_t>(unzigzag(c.varint()));
+    r.status = static_cast<int32_t>(unzigzag(c.varint()));
+    r.attachments.resize(c.varint());
+    for (auto& a : r.attachments) {
+        a.name = c.str();
+        a.hash = c.varint();
+    }
+    r.stages.resize(c.varint());
+    for (auto& s : r.stages) {
+        s.name = c.str();
+        s.ms = c.f32();
+        s.detail = c.str();
+    }
+    return r;
+}
+
+// Appends records to the capture file. Disabled (all calls no-ops) until
+// open() succeeds, so call sites don't need to check.
+class RequestCaptureLog {
+public:
+    RequestCaptureLog() : start(std::chrono::steady_clock::now()) {}
+    ~RequestCaptureLog() { close(); }
+
+    RequestCaptureLog(const RequestCaptureLog&) = delete;
+    RequestCaptureLog& operator=(const RequestCaptureLog&) = delete;
+
+    void open(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        file = fopen(path.c_str(), "wb");
+        if (!file) throw std::runtime_error("Cannot open capture file: " + path);
+        fwrite(capture_detail::kMagic, 1, sizeof(capture_detail::kMagic), file);
+        fputc(capture_detail::kVersion, file);
+        fflush(file);
+        start = std::chrono::steady_clock::now();
+    }
+
+    bool enabled() const { return file != nullptr; }
+
+    uint64_t now_us() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    void append(const CaptureRecord& record) {
+        std::string body = encode_capture_record(record);
+        std::string framed;
+        capture_detail::put_varint(framed, body.size());
+        framed += body;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file) return;
+        fwrite(framed.data(), 1, framed.size(), file);
+        fflush(file);
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file) fflush(file);
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+private:
+    FILE* file = nullptr;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Records one request when it goes out of scope, so every exit path of a
+// handler ends up in the log. status refers to the handler's response status;
+// a value below zero means the handler left it at the default 200.
+class CaptureScope {
+public:
+    CaptureScope(RequestCaptureLog& log, const RequestTimings& timings, const int& status,
+                 const std::string& endpoint, const std::string& payload)
+        : log(log), timings(timings), status(status) {
+        if (!log.enabled()) return;
+        record.arrival_us = log.now_us();
+        record.endpoint = endpoint;
+        record.payload = payload;
+    }
+
+    ~CaptureScope() {
+        if (!log.enabled()) return;
+        record.status = status < 0 ? 200 : status;
+        record.stages = timings.stages();
+        record.stages.push_back({"total", timings.total_ms(), ""});
+        log.append(record);
+    }
+
+    CaptureScope(const CaptureScope&) = delete;
+    CaptureScope& operator=(const CaptureScope&) = delete;
+
+    bool active() const { return log.enabled(); }
+
+    CaptureRecord record;   // handlers fill in seed, sampling and attachments
+
+private:
+    RequestCaptureLog& log;
+    const RequestTimings& timings;
+    const int& status;
+};
+
+// Sequential reader for a capture file
+class CaptureReader {
+public:
+    explicit CaptureReader(const std::string& path) : file(fopen(path.c_str(), "rb")) {
+        if (!file) throw std::runtime_error("Cannot open capture file: " + path);
+        char magic[4];
+        if (fread(magic, 1, 4, file) != 4 || std::memcmp(magic, capture_detail::kMagic, 4) != 0) {
+            fclose(file);
+            throw std::runtime_error("Not a capture file: " + path);
+        }
+        int version = fgetc(file);
+        if (version != capture_detail::kVersion) {
+            fclose(file);
+            throw std::runtime_error("Unsupported capture version: " + std::to_string(version));
+        }
+    }
+
+    ~CaptureReader() { if (file) fclose(file); }
+
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    // Returns false at end of file; a truncated trailing record is ignored
+    bool next(CaptureRecord& record) {
+        uint64_t size = 0;
+        for (int shift = 0;; shift += 7) {
+            int b = fgetc(file);
+            if (b == EOF || shift >= 64) return false;
+            size |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        std::string body(size, '\0');
+        if (fread(&body[0], 1, size, file) != size) return false;
+        record = decode_capture_record(body);
+        return true;
+    }
+
+private:
+    FILE* file;
+};
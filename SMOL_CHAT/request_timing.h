@@ -0,0 +1,114 @@
+// request_timing.h
+// Per-request stage timings shared by the persona and CV servers.
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct StageTiming {
+    std::string name;
+    double ms = 0.0;
+    std::string detail;     // free-form extra info, e.g. a token count
+    double start_ms = 0.0;  // offset from the start of the request
+};
+
+// Collects how long each pipeline stage of one request took. Not thread-safe:
+// work done on other threads reports back to the request's own thread.
+class RequestTimings {
+public:
+    using clock = std::chrono::steady_clock;
+
+    RequestTimings() : start(clock::now()), wall_start(std::chrono::system_clock::now()) {}
+
+    // Add a stage that has just finished. Adding a stage that already exists
+    // accumulates into it.
+    void add(const std::string& name, double ms, const std::string& detail = "") {
+        add_at(name, clock::now() - std::chrono::duration_cast<clock::duration>(
+                                        std::chrono::duration<double, std::milli>(ms)),
+               ms, detail);
+    }
+
+    // Add a stage that started at t0, for stages reported after the fact
+    void add_at(const std::string& name, clock::time_point t0, double ms, const std::string& detail = "") {
+        for (auto& stage : stage_list) {
+            if (stage.name == name) {
+                stage.ms += ms;
+                if (!detail.empty()) stage.detail = detail;
+                return;
+            }
+        }
+        stage_list.push_back({name, ms, detail,
+                              std::chrono::duration<double, std::milli>(t0 - start).count()});
+    }
+
+    const std::vector<StageTiming>& stages() const { return stage_list; }
+    double total_ms() const { return ms_since(start); }
+    std::chrono::system_clock::time_point started_at() const { return wall_start; }
+
+    // Value for a Server-Timing response header, e.g.
+    //   queue;dur=0.8, decode;dur=912.4;desc="41 tokens", total;dur=960.1
+    std::string server_timing_header() const {
+        std::string out;
+        char dur[32];
+        auto append = [&](const std::string& name, double ms, const std::string& detail) {
+            if (!out.empty()) out += ", ";
+            snprintf(dur, sizeof(dur), "%.2f", ms);
+            out += name;
+            out += ";dur=";
+            out += dur;
+            if (!detail.empty()) {
+                out += ";desc=\"";
+                for (char c : detail) {
+                    if (c == '"' || c == '\\') out += '\\';
+                    out += c;
+                }
+                out += '"';
+            }
+        };
+        for (const auto& stage : stage_list) append(stage.name, stage.ms, stage.detail);
+        append("total", total_ms(), "");
+        return out;
+    }
+
+    static double ms_since(clock::time_point t0) {
+        return std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+    }
+
+    // Sets the Server-Timing header when the handler returns, on every exit
+    // path. Works with any response type that has set_header().
+    template <typename Response>
+    class HeaderScope {
+    public:
+        HeaderScope(const RequestTimings& timings, Response& res) : timings(timings), res(res) {}
+        ~HeaderScope() { res.set_header("Server-Timing", timings.server_timing_header()); }
+        HeaderScope(const HeaderScope&) = delete;
+        HeaderScope& operator=(const HeaderScope&) = delete;
+
+    private:
+        const RequestTimings& timings;
+        Response& res;
+    };
+
+    // Times the enclosing scope as one stage
+    class Scope {
+    public:
+        Scope(RequestTimings& timings, std::string name)
+            : timings(timings), name(std::move(name)), t0(clock::now()) {}
+        ~Scope() { timings.add_at(name, t0, ms_since(t0)); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        RequestTimings& timings;
+        std::string name;
+        clock::time_point t0;
+    };
+
+private:
+    clock::time_point start;
+    std::chrono::system_clock::time_point wall_start;
+    std::vector<StageTiming> stage_list;
+};
@@ -0,0 +1,188 @@
+// shutdown.h
+// Graceful shutdown for the persona and CV servers.
+//
+// SIGINT/SIGTERM are blocked in every thread and picked up by one watcher
+// thread with sigtimedwait, so no work happens in a signal handler. On the
+// first signal /health starts reporting "draining", and after the grace
+// period the stop hooks run (svr.stop()). listen() then returns once the
+// connection threads have finished their in-flight requests, and main calls
+// finish() to run the flush hooks (capture log, trace export, caches).
+// If draining takes longer than the drain timeout, or a second signal
+// arrives, tracked child process groups (model CLIs, which sit in their
+// own group and so miss the terminal's signal) are sent SIGTERM, the flush
+// hooks run right away and the process exits.
+
+#pragma once
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class ShutdownCoordinator {
+public:
+    ShutdownCoordinator() = default;
+    // Stops the watcher without flushing, e.g. when main exits with an error
+    ~ShutdownCoordinator() {
+        finished = true;
+        if (watcher.joinable()) watcher.join();
+    }
+
+    ShutdownCoordinator(const ShutdownCoordinator&) = delete;
+    ShutdownCoordinator& operator=(const ShutdownCoordinator&) = delete;
+
+    // Runs when the server should stop accepting connections
+    void on_stop(std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop_hooks.push_back(std::move(fn));
+    }
+
+    // Runs once at exit, in registration order, after the drain or on timeout
+    void on_flush(std::string name, std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        flush_hooks.emplace_back(std::move(name), std::move(fn));
+    }
+
+    // Must be called before any other thread is started, so that every
+    // thread inherits the blocked signal mask.
+    void start(std::chrono::seconds grace, std::chrono::seconds drain_timeout) {
+        sigset_t set = signal_set();
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        this->grace = grace;
+        this->drain_timeout = drain_timeout;
+        watcher = std::thread(&ShutdownCoordinator::watch, this);
+    }
+
+    bool draining() const { return drain_started; }
+
+    // Child process groups to terminate on a forced exit. Lock-free, so a
+    // spawn never waits on the watcher; if every slot is taken the child is
+    // simply not tracked.
+    static void track_child(pid_t pgid) {
+        for (auto& slot : child_slots()) {
+            pid_t empty = 0;
+            if (slot.compare_exchange_strong(empty, pgid)) return;
+        }
+    }
+
+    static void untrack_child(pid_t pgid) {
+        for (auto& slot : child_slots()) {
+            pid_t expected = pgid;
+            if (slot.compare_exchange_strong(expected, 0)) return;
+        }
+    }
+
+    // Called by main once listen() has returned
+    void finish() {
+        run_flush_hooks();
+        finished = true;
+        if (watcher.joinable()) watcher.join();
+    }
+
+private:
+    static sigset_t signal_set() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        return set;
+    }
+
+    void watch() {
+        const sigset_t set = signal_set();
+        const timespec poll_interval{0, 200 * 1000 * 1000};
+        std::chrono::steady_clock::time_point stop_at;
+        std::chrono::steady_clock::time_point deadline;
+        bool stopped = false;
+
+        while (!finished) {
+            siginfo_t info;
+            int sig = sigtimedwait(&set, &info, &poll_interval);
+            auto now = std::chrono::steady_clock::now();
+
+            if (sig > 0) {
+                if (drain_started) {
+                    std::cerr << "[SHUTDOWN] Second signal, exiting without waiting for the drain" << std::endl;
+                    force_exit();
+                }
+                std::cout << "[SHUTDOWN] Received " << (sig == SIGINT ? "SIGINT" : "SIGTERM")
+                          << ", draining (grace " << grace.count() << " s, timeout "
+                          << drain_timeout.count() << " s)" << std::endl;
+                drain_started = true;
+                stop_at = now + grace;
+                deadline = stop_at + drain_timeout;
+            }
+            if (!drain_started) continue;
+
+            if (!stopped && now >= stop_at) {
+                std::cout << "[SHUTDOWN] No longer accepting connections" << std::endl;
+                std::vector<std::function<void()>> hooks;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    hooks = stop_hooks;
+                }
+                for (auto& hook : hooks) hook();
+                stopped = true;
+            }
+            if (stopped && now >= deadline && !flushed) {
+                std::cerr << "[SHUTDOWN] Drain timed out after " << drain_timeout.count()
+                          << " s, exiting with requests in flight" << std::endl;
+                force_exit();
+            }
+        }
+    }
+
+    void run_flush_hooks() {
+        if (flushed.exchange(true)) return;
+        std::vector<std::pair<std::string, std::function<void()>>> hooks;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            hooks = flush_hooks;
+        }
+        for (auto& [name, hook] : hooks) {
+            try {
+                hook();
+                std::cout << "[SHUTDOWN] Flushed " << name << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "[SHUTDOWN] Flushing " << name << " failed: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    static std::array<std::atomic<pid_t>, 256>& child_slots() {
+        static std::array<std::atomic<pid_t>, 256> slots{};
+        return slots;
+    }
+
+    [[noreturn]] void force_exit() {
+        size_t killed = 0;
+        for (auto& slot : child_slots()) {
+            pid_t pgid = slot.load();
+            if (pgid > 0 && kill(-pgid, SIGTERM) == 0) ++killed;
+        }
+        if (killed > 0) std::cerr << "[SHUTDOWN] Sent SIGTERM to " << killed << " child processes" << std::endl;
+        run_flush_hooks();
+        std::cout.flush();
+        _exit(1);
+    }
+
+    std::mutex mutex;
+    std::vector<std::function<void()>> stop_hooks;
+    std::vector<std::pair<std::string, std::function<void()>>> flush_hooks;
+    std::chrono::seconds grace{0};
+    std::chrono::seconds drain_timeout{30};
+    std::atomic<bool> drain_started{false};
+    std::atomic<bool> finished{false};
+    std::atomic<bool> flushed{false};
+    std::thread watcher;
+};
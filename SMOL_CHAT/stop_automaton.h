@@ -0,0 +1,139 @@
+// stop_automaton.h
+// Stop strings for the persona server's generation loop.
+//
+// StopAutomaton is an Aho-Corasick automaton over the stop strings, compiled
+// into a full byte transition table, so matching costs one table lookup per
+// byte with no string searches. On top of that, every vocabulary token is
+// flagged once if its piece contains any byte that occurs in a stop string.
+// Most tokens contain none; for those the automaton simply returns to its
+// start state, so advancing over a token is O(1) on the common path.
+//
+// A stop only counts once the output has real content (a letter or digit)
+// before it, so a model that opens with a blank line or a ``` fence is not
+// cut off before it has said anything.
+
+#pragma once
+
+#include "detokenizer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class StopAutomaton {
+public:
+    StopAutomaton(const std::vector<std::string>& stops, const PieceTable& table) : stop_list(stops) {
+        build(stops);
+        bool stop_byte[256] = {false};
+        for (const auto& s : stops) {
+            for (unsigned char c : s) stop_byte[c] = true;
+        }
+        relevant.resize(table.n_tokens());
+        for (size_t t = 0; t < relevant.size(); ++t) {
+            for (unsigned char c : table.piece((llama_token)t)) {
+                if (stop_byte[c]) {
+                    relevant[t] = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Per-sequence matching state
+    struct Cursor {
+        uint32_t state = 0;
+        size_t offset = 0;              // bytes of Detokenizer text consumed so far
+        size_t content_at = SIZE_MAX;   // offset of the first letter or digit
+    };
+
+    // Advances over the text a token completed (Detokenizer::push), so that
+    // offsets are positions in the detokenizer's text even where it held
+    // bytes back or replaced invalid ones. Returns the output length to keep
+    // (the offset where the stop string begins) if a stop ended in this
+    // text, otherwise SIZE_MAX. The per-token shortcut only applies when the
+    // text is the token's piece unchanged (verbatim).
+    size_t advance(Cursor& cur, llama_token t, std::string_view text, bool verbatim) const {
+        const size_t start = cur.offset;
+        cur.offset += text.size();
+        if (cur.content_at == SIZE_MAX) {
+            for (size_t i = 0; i < text.size(); ++i) {
+                if (std::isalnum((unsigned char)text[i])) {
+                    cur.content_at = start + i;
+                    break;
+                }
+            }
+        }
+        if (verbatim && (t < 0 || (size_t)t >= relevant.size() || !relevant[t])) {
+            cur.state = 0;
+            return SIZE_MAX;
+        }
+        for (size_t i = 0; i < text.size(); ++i) {
+            cur.state = next[cur.state * 256 + (unsigned char)text[i]];
+            const uint32_t len = match_len[cur.state];
+            if (len == 0) continue;
+            const size_t match_start = start + i + 1 - len;
+            if (cur.content_at < match_start) return match_start;
+        }
+        return SIZE_MAX;
+    }
+
+    const std::vector<std::string>& stops() const { return stop_list; }
+
+private:
+    void build(const std::vector<std::string>& stops) {
+        // Trie
+        std::vector<uint32_t> fail;
+        next.assign(256, 0);
+        match_len.assign(1, 0);
+        std::vector<bool> has_edge(256, false);
+        for (const auto& s : stops) {
+            if (s.empty()) continue;
+            uint32_t state = 0;
+            for (unsigned char c : s) {
+                size_t edge = state * 256 + c;
+                if (!has_edge[edge]) {
+                    next[edge] = (uint32_t)match_len.size();
+                    has_edge[edge] = true;
+                    match_len.push_back(0);
+                    next.resize(next.size() + 256, 0);
+                    has_edge.resize(has_edge.size() + 256, false);
+                }
+                state = next[edge];
+            }
+            match_len[state] = std::max<uint32_t>(match_len[state], (uint32_t)s.size());
+        }
+
+        // Breadth-first failure links, filling missing edges from the
+        // failure state so the table becomes a complete DFA. Each state
+        // reports the longest stop ending at it, including via its
+        // failure chain.
+        fail.assign(match_len.size(), 0);
+        std::deque<uint32_t> queue;
+        for (int c = 0; c < 256; ++c) {
+            if (has_edge[c]) queue.push_back(next[c]);
+        }
+        while (!queue.empty()) {
+            const uint32_t state = queue.front();
+            queue.pop_front();
+            match_len[state] = std::max(match_len[state], match_len[fail[state]]);
+            for (int c = 0; c < 256; ++c) {
+                const size_t edge = state * 256 + c;
+                if (has_edge[edge]) {
+                    fail[next[edge]] = next[fail[state] * 256 + c];
+                    queue.push_back(next[edge]);
+                } else {
+                    next[edge] = next[fail[state] * 256 + c];
+                }
+            }
+        }
+    }
+
+    std::vector<std::string> stop_list;
+    std::vector<uint32_t> next;         // state * 256 + byte -> state
+    std::vector<uint32_t> match_len;    // longest stop ending in a state, 0 = none
+    std::vector<uint8_t> relevant;      // token id -> piece has a stop-string byte
+};
@@ -0,0 +1,396 @@
+// tracing.h
+// OpenTelemetry-compatible request tracing for the persona and CV servers.
+// The incoming W3C traceparent header is continued if present, each
+// RequestTimings stage becomes a child span of the request span, and spans
+// are exported in batches as OTLP/HTTP JSON from a background thread, so a
+// slow or missing collector never holds up a request.
+
+#pragma once
+
+#include "httplib.h"
+#include "request_timing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Trace id and parent span id from (or for) a traceparent header:
+//   00-<32 hex trace id>-<16 hex parent span id>-<2 hex flags>
+struct TraceContext {
+    uint64_t trace_hi = 0;
+    uint64_t trace_lo = 0;
+    uint64_t parent_span_id = 0;
+    bool sampled = false;
+
+    bool valid() const { return trace_hi != 0 || trace_lo != 0; }
+
+    // Returns an invalid context for a missing or malformed header
+    static TraceContext parse(const std::string& header) {
+        TraceContext ctx;
+        if (header.size() < 55 || header[2] != '-' || header[35] != '-' || header[52] != '-') return ctx;
+        if (header.compare(0, 2, "ff") == 0) return ctx;
+        uint64_t hi, lo, parent, flags;
+        if (!parse_hex(header, 3, 16, hi) || !parse_hex(header, 19, 16, lo) ||
+            !parse_hex(header, 36, 16, parent) || !parse_hex(header, 53, 2, flags)) {
+            return ctx;
+        }
+        if ((hi == 0 && lo == 0) || parent == 0) return ctx;
+        ctx.trace_hi = hi;
+        ctx.trace_lo = lo;
+        ctx.parent_span_id = parent;
+        ctx.sampled = (flags & 0x01) != 0;
+        return ctx;
+    }
+
+    // Header for an outgoing call made from within span_id
+    std::string traceparent(uint64_t span_id) const {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "00-%016llx%016llx-%016llx-%02x",
+                 (unsigned long long)trace_hi, (unsigned long long)trace_lo,
+                 (unsigned long long)span_id, sampled ? 1 : 0);
+        return buf;
+    }
+
+private:
+    static bool parse_hex(const std::string& s, size_t pos, size_t len, uint64_t& out) {
+        out = 0;
+        for (size_t i = pos; i < pos + len; ++i) {
+            char c = s[i];
+            int v;
+            if (c >= '0' && c <= '9') v = c - '0';
+            else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+            else return false;   // the spec only allows lowercase
+            out = (out << 4) | v;
+        }
+        return true;
+    }
+};
+
+struct SpanData {
+    uint64_t trace_hi = 0;
+    uint64_t trace_lo = 0;
+    uint64_t span_id = 0;
+    uint64_t parent_span_id = 0;    // 0 = root span
+    std::string name;
+    int kind = 1;                   // OTLP SpanKind: 1 internal, 2 server
+    uint64_t start_ns = 0;          // unix epoch nanoseconds
+    uint64_t end_ns = 0;
+    std::vector<std::pair<std::string, std::string>> attributes;
+    int http_status = 0;            // 0 = not an HTTP span
+};
+
+inline uint64_t random_span_id() {
+    thread_local std::mt19937_64 gen{std::random_device{}()};
+    uint64_t id;
+    do { id = gen(); } while (id == 0);
+    return id;
+}
+
+namespace tracing_detail {
+
+inline void append_json_string(std::string& out, const std::string& s) {
+    out += '"';
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
+
+inline void append_hex(std::string& out, uint64_t v) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+    out += buf;
+}
+
+inline void append_string_attribute(std::string& out, const std::string& key, const std::string& value) {
+    out += "{\"key\":";
+    append_json_string(out, key);
+    out += ",\"value\":{\"stringValue\":";
+    append_json_string(out, value);
+    out += "}}";
+}
+
+// OTLP/HTTP JSON body (ExportTraceServiceRequest) for one batch
+inline std::string encode_otlp(const std::string& service_name, const std::vector<SpanData>& spans) {
+    std::string out;
+    out.reserve(256 + spans.size() * 320);
+    out += "{\"resourceSpans\":[{\"resource\":{\"attributes\":[";
+    append_string_attribute(out, "service.name", service_name);
+    out += "]},\"scopeSpans\":[{\"scope\":{\"name\":\"smol_chat\"},\"spans\":[";
+    for (size_t i = 0; i < spans.size(); ++i) {
+        const SpanData& s = spans[i];
+        if (i) out += ',';
+        out += "{\"traceId\":\"";
+        append_hex(out, s.trace_hi);
+        append_hex(out, s.trace_lo);
+        out += "\",\"spanId\":\"";
+        append_hex(out, s.span_id);
+        out += '"';
+        if (s.parent_span_id) {
+            out += ",\"parentSpanId\":\"";
+            append_hex(out, s.parent_span_id);
+            out += '"';
+        }
+        out += ",\"name\":";
+        append_json_string(out, s.name);
+        out += ",\"kind\":" + std::to_string(s.kind);
+        out += ",\"startTimeUnixNano\":\"" + std::to_string(s.start_ns) + "\"";
+        out += ",\"endTimeUnixNano\":\"" + std::to_string(s.end_ns) + "\"";
+        out += ",\"attributes\":[";
+        bool first = true;
+        for (const auto& [key, value] : s.attributes) {
+            if (!first) out += ',';
+            first = false;
+            append_string_attribute(out, key, value);
+        }
+        if (s.http_status) {
+            if (!first) out += ',';
+            out += "{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":\"" +
+                   std::to_string(s.http_status) + "\"}}";
+        }
+        out += ']';
+        if (s.http_status >= 500) out += ",\"status\":{\"code\":2}";
+        out += '}';
+    }
+    out += "]}]}]}";
+    return out;
+}
+
+}  // namespace tracing_detail
+
+// Queues finished spans and exports them from a background thread. Disabled
+// (submit() drops everything) until start() is called with an endpoint.
+class Tracer {
+public:
+    struct Config {
+        std::string endpoint;           // collector base URL, e.g. http://localhost:4318
+        std::string service_name;
+        double sample_ratio = 1.0;      // for requests without a sampled parent
+        size_t max_queue = 8192;        // spans beyond this are dropped
+        size_t max_batch = 512;
+        int flush_interval_ms = 2000;
+    };
+
+    Tracer() = default;
+    ~Tracer() { stop(); }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    void start(Config cfg) {
+        if (cfg.endpoint.empty()) return;
+        config = std::move(cfg);
+        // A bare collector URL gets the standard OTLP traces path
+        size_t scheme = config.endpoint.find("://");
+        size_t path_pos = config.endpoint.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+        if (path_pos == std::string::npos) {
+            base_url = config.endpoint;
+            path = "/v1/traces";
+        } else {
+            base_url = config.endpoint.substr(0, path_pos);
+            path = config.endpoint.substr(path_pos);
+        }
+        running = true;
+        exporter = std::thread(&Tracer::export_loop, this);
+    }
+
+    bool enabled() const { return running; }
+
+    // Continues the caller's trace if there is one, honouring its sampling
+    // decision; otherwise starts a new trace sampled at sample_ratio.
+    TraceContext begin(const std::string& traceparent_header) const {
+        TraceContext ctx = TraceContext::parse(traceparent_header);
+        if (!running) return ctx;
+        if (!ctx.valid()) {
+            ctx.trace_hi = random_span_id();
+            ctx.trace_lo = random_span_id();
+            thread_local std::mt19937_64 gen{std::random_device{}()};
+            ctx.sampled = std::uniform_real_distribution<double>(0.0, 1.0)(gen) < config.sample_ratio;
+        }
+        return ctx;
+    }
+
+    // Never blocks on export; drops the spans if the queue is full
+    void submit(std::vector<SpanData>&& spans) {
+        if (!running || spans.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending.size() + spans.size() > config.max_queue) {
+                dropped += spans.size();
+                return;
+            }
+            for (auto& span : spans) pending.push_back(std::move(span));
+            if (pending.size() < config.max_batch) return;
+        }
+        cv.notify_one();
+    }
+
+    // Exports everything queued so far and waits for it
+    void flush() {
+        if (!running) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        flush_requested = true;
+        cv.notify_one();
+        idle_cv.wait(lock, [this] { return (pending.empty() && !exporting) || !running; });
+    }
+
+    void stop() {
+        if (!exporter.joinable()) return;
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        exporter.join();
+        if (dropped > 0) {
+            std::cerr << "[TRACE] Dropped " << dropped << " spans (queue full)" << std::endl;
+        }
+    }
+
+private:
+    void export_loop() {
+        httplib::Client client(base_url);
+        client.set_connection_timeout(2);
+        client.set_read_timeout(5);
+        bool last_failed = false;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            cv.wait_for(lock, std::chrono::milliseconds(config.flush_interval_ms), [this] {
+                return !running || flush_requested || pending.size() >= config.max_batch;
+            });
+            flush_requested = false;
+            while (!pending.empty()) {
+                size_t n = std::min(pending.size(), config.max_batch);
+                std::vector<SpanData> batch(std::make_move_iterator(pending.begin()),
+                                            std::make_move_iterator(pending.begin() + n));
+                pending.erase(pending.begin(), pending.begin() + n);
+                exporting = true;
+                lock.unlock();
+
+                std::string body = tracing_detail::encode_otlp(config.service_name, batch);
+                auto res = client.Post(path, body, "application/json");
+                bool failed = !res || res->status < 200 || res->status >= 300;
+                // Only log transitions so a missing collector doesn't flood the log
+                if (failed && !last_failed) {
+                    std::cerr << "[TRACE] Export to " << base_url << path << " failed: "
+                              << (res ? "status " + std::to_string(res->status) : std::string("no response"))
+                              << std::endl;
+                } else if (!failed && last_failed) {
+                    std::cout << "[TRACE] Export to " << base_url << path << " recovered" << std::endl;
+                }
+                last_failed = failed;
+
+                lock.lock();
+                exporting = false;
+            }
+            idle_cv.notify_all();
+        }
+    }
+
+    Config config;
+    std::string base_url;
+    std::string path;
+    std::atomic<bool> running{false};
+    bool flush_requested = false;
+    bool exporting = false;
+    size_t dropped = 0;
+    std::deque<SpanData> pending;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable idle_cv;
+    std::thread exporter;
+};
+
+// Traces one request: a server span covering the handler plus one child span
+// per recorded stage, submitted when the scope ends. status refers to the
+// handler's response status; below zero means it was left at the default 200.
+class TraceScope {
+public:
+    TraceScope(Tracer& tracer, const RequestTimings& timings, const int& status,
+               const std::string& method, const std::string& route, const std::string& traceparent_header)
+        : tracer(tracer), timings(timings), status(status), method(method), route(route),
+          ctx(tracer.begin(traceparent_header)), span_id(random_span_id()) {}
+
+    ~TraceScope() {
+        if (!tracer.enabled() || !ctx.sampled) return;
+        const uint64_t origin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            timings.started_at().time_since_epoch()).count();
+        auto to_ns = [origin_ns](double ms) { return origin_ns + static_cast<uint64_t>(std::max(0.0, ms) * 1e6); };
+
+        std::vector<SpanData> spans;
+        spans.reserve(timings.stages().size() + 1);
+        SpanData root;
+        root.trace_hi = ctx.trace_hi;
+        root.trace_lo = ctx.trace_lo;
+        root.span_id = span_id;
+        root.parent_span_id = ctx.parent_span_id;
+        root.name = method + " " + route;
+        root.kind = 2;
+        root.start_ns = origin_ns;
+        root.end_ns = to_ns(timings.total_ms());
+        root.attributes = {{"http.request.method", method}, {"http.route", route}};
+        root.http_status = status < 0 ? 200 : status;
+        spans.push_back(std::move(root));
+
+        for (const auto& stage : timings.stages()) {
+            SpanData span;
+            span.trace_hi = ctx.trace_hi;
+            span.trace_lo = ctx.trace_lo;
+            span.span_id = random_span_id();
+            span.parent_span_id = span_id;
+            span.name = stage.name;
+            span.start_ns = to_ns(stage.start_ms);
+            span.end_ns = to_ns(stage.start_ms + stage.ms);
+            if (!stage.detail.empty()) span.attributes.emplace_back("detail", stage.detail);
+            spans.push_back(std::move(span));
+        }
+        tracer.submit(std::move(spans));
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    // traceparent for calls made while handling this request, or empty if
+    // there is no trace to continue. With tracing off the caller's context
+    // is passed through unchanged.
+    std::string traceparent() const {
+        if (!ctx.valid()) return std::string();
+        return ctx.traceparent(tracer.enabled() ? span_id : ctx.parent_span_id);
+    }
+
+private:
+    Tracer& tracer;
+    const RequestTimings& timings;
+    const int& status;
+    std::string method;
+    std::string route;
+    TraceContext ctx;
+    uint64_t span_id;
+};